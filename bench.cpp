@@ -0,0 +1,266 @@
+#define BASE_TEST_REGEX
+#include <chrono>
+#include <cstdio>
+#include <string>
+#include "test.hpp"
+
+// Prints one tab separated `group metric value` line per result, so runs can
+// be diffed or loaded into a spreadsheet to track regressions.
+
+// Integer tagged grammar: generated keyword rules followed by the TOKEN_TYPE
+// rules, lower rule index wins.
+using BL = RegexLexer<u16, 0, [](u16 a, u16 b) { return !a ? b : !b ? a : std::min(a, b); }>;
+
+static std::vector<std::string> grammar(i32 extra) {
+  std::vector<std::string> rules;
+  u32 seed = 12345;
+  const auto rand = [&]() { return seed = seed * 1664525 + 1013904223, seed >> 16; };
+  for (auto i = 0; i < extra; ++i) {
+    std::string word;
+    const auto len = 3 + rand() % 8;
+    for (auto j = 0; j < len; ++j) word.push_back('a' + rand() % 26);
+    rules.push_back(word);
+  }
+#define _(t, r) rules.push_back(r);
+TOKEN_TYPE(_)
+#undef _
+  return rules;
+}
+
+template <typename F>
+static double elapsed(F&& f) {
+  const auto t0 = std::chrono::steady_clock::now();
+  f();
+  return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count();
+}
+
+// Best of a few runs, in milliseconds.
+template <typename F>
+static double best(F&& f, i32 runs = 5) {
+  auto out = elapsed(f);
+  for (auto i = 1; i < runs; ++i) out = std::min(out, elapsed(f));
+  return out;
+}
+
+// Makes the compiler assume `x` is read, so the work producing it is kept.
+template <typename T>
+static void keep(const T& x) {
+  asm volatile("" : : "r"(&x) : "memory");
+}
+
+// Megabytes, 10^6 bytes, for the _mb_s rates.
+static double megabytes(const std::string& text) { return text.size() / 1e6; }
+
+static void report(const std::string& group, const char* metric, double value) {
+  printf("%s\t%s\t%.3f\n", group.c_str(), metric, value);
+}
+
+static void construction() {
+  for (const auto extra : { 0, 50, 200 }) {
+    const auto rules = grammar(extra);
+    const auto group = "construct/" + std::to_string(rules.size());
+    BL regex;
+    report(group, "parse_ms", elapsed([&] {
+      for (auto i = 0; i < rules.size(); ++i) regex.alter(BL::parse(rules[i], i + 1));
+    }));
+    report(group, "nfa_states", regex.states.size());
+    report(group, "nfa_edges", regex.transitions.edges.size());
+
+    std::vector<std::pair<std::string_view, u16>> pairs;
+    for (auto i = 0; i < rules.size(); ++i) pairs.push_back({ rules[i], i + 1 });
+    report(group, "from_rules_ms", elapsed([&] { keep(BL::fromRules(pairs)); }));
+
+    // dfa() consumes the NFA, so every run gets a copy made outside the timing.
+    const auto dfaMs = [&](i32 threads) {
+      auto out = std::numeric_limits<double>::max();
+      for (auto i = 0; i < 5; ++i) {
+        auto x = regex;
+        out = std::min(out, elapsed([&] { x.dfa(threads); }));
+      }
+      return out;
+    };
+    const i32 threads = std::thread::hardware_concurrency();
+    report(group, "dfa_ms", dfaMs(1));
+    report(group, "dfa_parallel_ms", dfaMs(threads));
+    report(group, "dfa_threads", threads);
+    regex.dfa();
+    report(group, "dfa_states", regex.states.size());
+    auto naive = regex;
+    report(group, "minimise_naive_ms", elapsed([&] { naive.minimiseNaive(); }));
+    report(group, "minimise_ms", elapsed([&] { regex.minimise(); }));
+    auto transitions = 0;
+    for (auto i = 0; i < regex.dead * regex.classes; ++i) transitions += regex.table[i] != regex.dead;
+    report(group, "states", regex.states.size());
+    report(group, "classes", regex.classes);
+    report(group, "transitions", transitions);
+    REGEX_STAT(
+      report(group, "subset_peak", regex.stats.subsetPeak);
+      report(group, "minimise_rounds", regex.stats.minimiseRounds);
+      report(group, "table_bytes", regex.stats.tableBytes);
+    )
+  }
+}
+
+// The generated words as keyword rules, and as a keyword table over the
+// Identifier rule instead.
+static void keywords() {
+  constexpr auto EXTRA = 200;
+  const auto rules = grammar(EXTRA);
+  // Identifier is the 12th TOKEN_TYPE rule.
+  const u16 identifier = EXTRA + 12;
+  std::vector<std::pair<std::string_view, u16>> all, words;
+  for (auto i = 0; i < rules.size(); ++i) (i < EXTRA ? words : all).push_back({ rules[i], i + 1 });
+  auto keyworded = BL::fromRules(all);
+  keyworded.withKeywords(words, identifier).dfa().minimise();
+  all.insert(all.begin(), words.begin(), words.end());
+  auto ruled = BL::fromRules(all);
+  ruled.dfa().minimise();
+
+  const auto group = "keywords/" + std::to_string(EXTRA);
+  report(group, "rule_states", ruled.states.size());
+  report(group, "rule_table_bytes", ruled.table.size() * sizeof(i32));
+  report(group, "table_states", keyworded.states.size());
+  report(group, "table_table_bytes", keyworded.table.size() * sizeof(i32));
+  report(group, "keyword_bytes", keyworded.keywords.bytes());
+  std::string text;
+  for (auto i = 0; text.size() < 4 << 20; ++i) text += rules[i % rules.size() % EXTRA] + " ident" + std::to_string(i) + " ";
+  const auto mb = megabytes(text);
+  report(group, "rule_tokenize_mb_s", mb / best([&] { keep(ruled.tokenize(text)); }) * 1000);
+  report(group, "table_tokenize_mb_s", mb / best([&] { keep(keyworded.tokenize(text)); }) * 1000);
+}
+
+// Rules that are mostly wide byte classes: negated ones and a run of high
+// bytes, as in UTF-8 aware grammars.
+static void classes() {
+  std::vector<std::string> rules;
+  for (auto i = 0; i < 10; ++i) rules.push_back(std::string("[^") + char('a' + i) + char('0' + i) + "]+[\x80-\xbf]" + char('a' + i));
+  const auto group = "construct/classes";
+  BL regex;
+  report(group, "parse_ms", elapsed([&] {
+    for (auto i = 0; i < rules.size(); ++i) regex.alter(BL::parse(rules[i], i + 1));
+  }));
+  report(group, "nfa_edges", regex.transitions.edges.size());
+  report(group, "dfa_ms", elapsed([&] { regex.dfa(); }));
+  report(group, "dfa_states", regex.states.size());
+}
+
+static std::vector<std::pair<const char*, std::string>> corpora() {
+  constexpr auto SIZE = 4 << 20;
+  std::vector<std::pair<const char*, std::string>> out;
+  const auto fill = [&](const char* name, auto&& piece) {
+    std::string s;
+    for (auto i = 0; s.size() < SIZE; ++i) s += piece(i);
+    out.push_back({ name, std::move(s) });
+  };
+  fill("source", [](i32 i) {
+    return "fn f" + std::to_string(i) + "(a, b) :: c {\n  while x isnot y { z = \"s\" + b[0]; }\n  return a # b\n}\n";
+  });
+  fill("strings", [](i32) { return "\"" + std::string(4000, 'q') + "\" "; });
+  fill("whitespace", [](i32 i) { return std::string(i % 61, ' ') + "\t\n" + (i % 7 ? "" : "x"); });
+  // An unclosed string at the front runs the String rule to the end before
+  // it backs out, then tokens broken up by bytes no rule starts with.
+  fill("adversarial", [](i32 i) { return i ? "!=!~`a'@isno " : "\"!~"; });
+  return out;
+}
+
+static void matching() {
+  BL regex;
+  const auto rules = grammar(0);
+  for (auto i = 0; i < rules.size(); ++i) regex.alter(BL::parse(rules[i], i + 1));
+  LazyRegexLexer<BL> lazy(regex);
+  regex.dfa().minimise();
+  // The same table with no state accelerated, to show short runs cost
+  // nothing extra.
+  auto plain = regex;
+  std::fill(plain.accel.begin(), plain.accel.end(), Accel {});
+
+  for (const auto& [name, text] : corpora()) {
+    const auto group = std::string("match/") + name;
+    const auto mb = megabytes(text);
+    size_t tokens = 0;
+    report(group, "tokenize_mb_s", mb / best([&] { tokens = regex.tokenize(text, Recovery::Skip).size(); }) * 1000);
+    report(group, "tokens", tokens);
+    report(group, "tokenize_unaccelerated_mb_s", mb / best([&] { keep(plain.tokenize(text, Recovery::Skip)); }) * 1000);
+    report(group, "tokenize_parallel_mb_s", mb / best([&] { keep(regex.tokenizeParallel(text, Recovery::Skip)); }) * 1000);
+    report(group, "stream_mb_s", mb / best([&] {
+      StreamLexer<u16, 0> stream(regex.view(), Recovery::Skip);
+      size_t count = 0;
+      const auto emit = [&](u16, u64, u64) { ++count; };
+      for (size_t i = 0; i < text.size(); i += 1 << 16) stream.push(std::string_view(text).substr(i, 1 << 16), emit);
+      stream.finish(emit);
+      keep(count);
+    }) * 1000);
+    report(group, "lazy_tokenize_mb_s", mb / best([&] { keep(lazy.tokenize(text, Recovery::Skip)); }, 2) * 1000);
+  }
+}
+
+// Short independent strings, as when classifying identifiers or field
+// names one at a time.
+static void classifying() {
+  const auto rules = grammar(200);
+  BL regex;
+  for (auto i = 0; i < rules.size(); ++i) regex.alter(BL::parse(rules[i], i + 1));
+  regex.dfa().minimise();
+  constexpr auto N = 1 << 20;
+  std::vector<std::string> words;
+  for (auto i = 0; i < N; ++i) words.push_back(i % 3 ? rules[i % 200] : "ident_" + std::to_string(i));
+  const std::vector<std::string_view> views(words.begin(), words.end());
+  std::vector<u16> tags(N);
+  const auto mops = [&](double ms) { return N / ms / 1000; };
+  report("classify", "match_mops", mops(best([&] { for (auto i = 0; i < N; ++i) tags[i] = regex.match(views[i]); keep(tags); })));
+  report("classify", "match_many_mops", mops(best([&] { regex.matchMany(views, tags); keep(tags); })));
+}
+
+// Tokenizing with the 239 rule grammar's table, whose 256 KB outgrow L1,
+// as built and after renumbering for locality.
+static void locality() {
+  const auto rules = grammar(200);
+  BL regex;
+  for (auto i = 0; i < rules.size(); ++i) regex.alter(BL::parse(rules[i], i + 1));
+  regex.dfa().minimise();
+  std::string text;
+  for (auto i = 0; text.size() < 4 << 20; ++i) {
+    text += rules[i * 7919 % 200] + "(x" + std::to_string(i) + ", \"s\") == y;\n";
+  }
+  const auto mb = megabytes(text);
+  auto bfs = regex, profiled = regex;
+  bfs.renumber();
+  profiled.renumber(std::string_view(text).substr(0, 1 << 16));
+  report("locality", "tokenize_mb_s", mb / best([&] { keep(regex.tokenize(text)); }) * 1000);
+  report("locality", "bfs_tokenize_mb_s", mb / best([&] { keep(bfs.tokenize(text)); }) * 1000);
+  report("locality", "profiled_tokenize_mb_s", mb / best([&] { keep(profiled.tokenize(text)); }) * 1000);
+}
+
+static void interning() {
+  constexpr auto N = 1 << 20;
+  std::vector<std::string> words;
+  for (auto i = 0; i < N; ++i) words.push_back("ident_" + std::to_string(i * 2654435761u));
+  const auto mops = [&](double ms) { return N / ms / 1000; };
+
+  report("fly/string", "intern_new_mops", mops(elapsed([&] { for (const auto& w : words) FlyString x(w); })));
+  report("fly/string", "intern_hit_mops", mops(best([&] { for (const auto& w : words) FlyString x(w); })));
+  report("fly/string", "find_mops", mops(best([&] { for (const auto& w : words) keep(FlyString::find(w)); })));
+  std::vector<FlyString> flies(words.begin(), words.end());
+  size_t bytes = 0;
+  report("fly/string", "val_mops", mops(best([&] { for (const auto& f : flies) bytes += f.val().size(); keep(bytes); })));
+
+  report("fly/shared", "intern_new_mops", mops(elapsed([&] { for (const auto& w : words) SharedFlyString x(w); })));
+  report("fly/shared", "intern_hit_mops", mops(best([&] { for (const auto& w : words) SharedFlyString x(w); })));
+
+  FlyCountedPool<std::string> counted;
+  report("fly/counted", "intern_release_mops", mops(best([&] {
+    for (const auto& w : words) FlyResource<std::string, FlyCountedPool<std::string>> x(w, counted);
+  })));
+}
+
+int main(int argc, char** argv) {
+  printf("group\tmetric\tvalue\n");
+  construction();
+  classes();
+  keywords();
+  matching();
+  classifying();
+  locality();
+  interning();
+  return 0;
+}
@@ -1,63 +1,352 @@
 #pragma once
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <optional>
 #include <stdexcept>
 #include <string>
+#include <string_view>
+#include <unordered_set>
+#include <utility>
+#include <vector>
 
+// An interned value. Nodes never move once made, so a handle is just a
+// pointer to one and reading it never touches the pool.
 template <typename T>
-struct FlyResource {
-  FlyResource() {}
-  FlyResource(const FlyResource& x) { *this = x; }
-  FlyResource(FlyResource&& x) { *this = std::move(x); }
-  FlyResource& operator=(const FlyResource& x) {
-    hash = x.hash;
-    i = x.i;
-    return *this;
+struct FlyNode {
+  size_t hash;
+  T val;
+};
+
+// Node pointers looked up by (hash, value) without building a node first.
+template <typename Node>
+struct FlyIndex {
+  template <typename T>
+  struct Key {
+    size_t hash;
+    const T& val;
+  };
+  struct Hash {
+    using is_transparent = void;
+    size_t operator()(const Node* x) const { return x->hash; }
+    template <typename T> size_t operator()(const Key<T>& x) const { return x.hash; }
+  };
+  struct Eq {
+    using is_transparent = void;
+    bool operator()(const Node* a, const Node* b) const { return a == b; }
+    template <typename T> bool operator()(const Key<T>& a, const Node* b) const { return a.hash == b->hash && a.val == b->val; }
+    template <typename T> bool operator()(const Node* a, const Key<T>& b) const { return (*this)(b, a); }
+  };
+
+  template <typename T>
+  const Node* find(const T& val, size_t hash) const {
+    const auto found = set.find(Key<T> { hash, val });
+    return found == set.end() ? nullptr : *found;
   }
-  FlyResource& operator=(FlyResource&& x) {
-    std::swap(hash, x.hash);
-    std::swap(i, x.i);
-    return *this;
+
+  std::unordered_set<const Node*, Hash, Eq> set;
+};
+
+// The original pool: one hash set, no locking, and values are kept until
+// the pool itself goes. Pools besides global() can be made for a scope,
+// e.g. one per compilation unit, and dropped as a unit along with every
+// value in them; handles into one must not outlive it.
+template <typename T>
+struct FlyPool {
+  using node_t = FlyNode<T>;
+
+  const node_t* intern(const T& val, size_t hash) {
+    if (const auto* found = index.find(val, hash)) return found;
+    auto* node = &nodes.emplace_back(node_t { hash, val });
+    index.set.insert(node);
+    return node;
+  }
+
+  // Handles call these on copy and destruction; nothing to do here.
+  static void retain(const node_t*) {}
+  static void release(const node_t*) {}
+
+  size_t size() const { return nodes.size(); }
+
+  static FlyPool& global() {
+    static FlyPool pool;
+    return pool;
   }
-  FlyResource(const T& val) {
-    hash = std::hash<T>()(val);
-    auto& t = fly[hash];
-    const auto found = std::find(t.begin(), t.end(), val);
-    if (found == t.end()) {
-      i = t.size();
-      t.push_back(val);
+
+private:
+  std::deque<node_t> nodes;
+  FlyIndex<node_t> index;
+};
+
+// A pool that frees each value once the last handle to it is gone, and
+// reuses its slot for the next new value, so memory stays flat when values
+// come and go. Copies only touch the count; the lock is taken to intern
+// and to drop a count that may reach zero, so a value can't be found by
+// intern() while it is being freed.
+template <typename T>
+struct FlyCountedPool {
+  struct node_t {
+    size_t hash;
+    T val;
+    mutable std::atomic<size_t> refs;
+    FlyCountedPool* pool;
+  };
+
+  const node_t* intern(const T& val, size_t hash) {
+    std::lock_guard guard(lock);
+    if (const auto* found = index.find(val, hash)) {
+      found->refs.fetch_add(1, std::memory_order_relaxed);
+      return found;
+    }
+    node_t* node;
+    if (spare.size()) {
+      node = spare.back();
+      spare.pop_back();
+      node->hash = hash;
+      node->val = val;
+      node->refs.store(1, std::memory_order_relaxed);
     }
     else {
-      i = found - t.begin();
+      node = &nodes.emplace_back(hash, val, 1, this);
+    }
+    index.set.insert(node);
+    return node;
+  }
+
+  static void retain(const node_t* node) {
+    if (node) node->refs.fetch_add(1, std::memory_order_relaxed);
+  }
+
+  static void release(const node_t* node) {
+    if (!node) return;
+    for (auto refs = node->refs.load(std::memory_order_relaxed); refs > 1;) {
+      if (node->refs.compare_exchange_weak(refs, refs - 1, std::memory_order_release, std::memory_order_relaxed)) return;
     }
+    node->pool->drop(node);
+  }
+
+  // Live values.
+  size_t size() const {
+    std::lock_guard guard(lock);
+    return index.set.size();
+  }
+
+  static FlyCountedPool& global() {
+    static FlyCountedPool pool;
+    return pool;
+  }
+
+private:
+  void drop(const node_t* node) {
+    std::lock_guard guard(lock);
+    if (node->refs.fetch_sub(1, std::memory_order_acq_rel) != 1) return;
+    index.set.erase(node);
+    auto* n = const_cast<node_t*>(node);
+    n->val = T();
+    spare.push_back(n);
+  }
+
+  mutable std::mutex lock;
+  std::deque<node_t> nodes;
+  std::vector<node_t*> spare;
+  FlyIndex<node_t> index;
+};
+
+// A pool threads can intern into concurrently. Values are spread over
+// SHARDS independently locked FlyPools by hash, so threads only contend
+// when they hit the same shard at the same time.
+template <typename T, size_t SHARDS = 64>
+struct FlyShardedPool {
+  using node_t = FlyNode<T>;
+
+  static void retain(const node_t*) {}
+  static void release(const node_t*) {}
+
+  const node_t* intern(const T& val, size_t hash) {
+    // The shard's own table indexes by the low bits, so pick by the high ones.
+    auto& shard = shards[((hash * 0x9e3779b97f4a7c15ull) >> 32) % SHARDS];
+    std::lock_guard lock(shard.lock);
+    return shard.pool.intern(val, hash);
+  }
+
+  static FlyShardedPool& global() {
+    static FlyShardedPool pool;
+    return pool;
+  }
+
+private:
+  struct alignas(64) Shard {
+    std::mutex lock;
+    FlyPool<T> pool;
+  };
+  std::array<Shard, SHARDS> shards;
+};
+
+template <typename T, typename Pool = FlyPool<T>>
+struct FlyResource {
+  FlyResource() {}
+  FlyResource(const T& val, Pool& pool = Pool::global()) : node(pool.intern(val, std::hash<T>()(val))) {}
+  FlyResource(const FlyResource& x) : node(x.node) { Pool::retain(node); }
+  FlyResource(FlyResource&& x) : node(std::exchange(x.node, nullptr)) {}
+  FlyResource& operator=(FlyResource x) {
+    std::swap(node, x.node);
+    return *this;
   }
+  ~FlyResource() { Pool::release(node); }
 
-  const T& val() const { if (i == std::numeric_limits<size_t>::max()) throw std::runtime_error("Uninitialised FlyResource accessed"); return fly[hash][i]; }
+  const T& val() const { if (!node) throw std::runtime_error("Uninitialised FlyResource accessed"); return node->val; }
   explicit operator const T&() const { return val(); }
   const T* const operator->() const { return &val(); }
   const T& operator*() const { return val(); }
 
   bool operator==(const FlyResource& x) const {
-    return hash == x.hash && i == x.i;
+    return node == x.node;
   }
 
   bool operator==(const T& x) const {
-    FlyResource xf(x);
-    return *this == xf;
+    return node && node->val == x;
   }
 
 private:
-  using fly_t = std::unordered_map<size_t, std::vector<const T>>;
-  static inline fly_t fly;
-  size_t hash {};
-  size_t i { std::numeric_limits<size_t>::max() };
+  const typename Pool::node_t* node = nullptr;
 
   friend std::hash<FlyResource>;
 };
 
-template <typename T>
-struct std::hash<FlyResource<T>> {
-  constexpr size_t operator()(const FlyResource<T>& k) const {
-    return k.hash;
+template <typename T, typename Pool>
+struct std::hash<FlyResource<T, Pool>> {
+  size_t operator()(const FlyResource<T, Pool>& k) const {
+    return k.node ? k.node->hash : 0;
+  }
+};
+
+// Strings interned back to back into large chunks and numbered densely
+// from 0, so an interned string costs its bytes plus a view and a hash, and
+// an id is enough to compare or hash it. Chunks never move, so views stay
+// valid for the pool's lifetime. Not thread safe.
+struct StringPool {
+  static constexpr std::uint32_t NONE = std::numeric_limits<std::uint32_t>::max();
+  static constexpr size_t CHUNK = 1 << 16;
+
+  std::uint32_t intern(std::string_view str) {
+    const auto h = hash(str);
+    auto& slot = slots[find(str, h)];
+    if (slot != NONE) return slot;
+    slot = views.size();
+    views.push_back(store(str));
+    hashes.push_back(h);
+    if (views.size() * 2 > slots.size()) grow();
+    return views.size() - 1;
+  }
+
+  // The id of `str` if it has been interned, without adding it.
+  std::optional<std::uint32_t> lookup(std::string_view str) const {
+    const auto id = slots[find(str, hash(str))];
+    if (id == NONE) return {};
+    return id;
+  }
+
+  std::string_view operator[](std::uint32_t id) const { return views[id]; }
+  size_t size() const { return views.size(); }
+
+  static StringPool& global() {
+    static StringPool pool;
+    return pool;
+  }
+
+private:
+  static std::uint32_t hash(std::string_view str) {
+    const auto h = std::hash<std::string_view>()(str);
+    return h ^ (h >> 32);
+  }
+
+  // The slot holding `str`, or the empty one it would go in.
+  size_t find(std::string_view str, std::uint32_t h) const {
+    const auto mask = slots.size() - 1;
+    for (auto i = h & mask;; i = (i + 1) & mask) {
+      const auto id = slots[i];
+      if (id == NONE || (hashes[id] == h && views[id] == str)) return i;
+    }
+  }
+
+  void grow() {
+    slots.assign(slots.size() * 2, NONE);
+    const auto mask = slots.size() - 1;
+    for (std::uint32_t id = 0; id < views.size(); ++id) {
+      auto i = hashes[id] & mask;
+      while (slots[i] != NONE) i = (i + 1) & mask;
+      slots[i] = id;
+    }
+  }
+
+  // Strings longer than a chunk get one to themselves, slotted in behind
+  // the chunk being filled so that one stays last.
+  std::string_view store(std::string_view str) {
+    if (str.empty()) return {};
+    if (str.size() > CHUNK) {
+      auto own = std::make_unique<char[]>(str.size());
+      std::copy(str.begin(), str.end(), own.get());
+      const auto* at = own.get();
+      chunks.insert(chunks.end() - !chunks.empty(), std::move(own));
+      return { at, str.size() };
+    }
+    if (str.size() > CHUNK - used) {
+      chunks.push_back(std::make_unique<char[]>(CHUNK));
+      used = 0;
+    }
+    auto* at = chunks.back().get() + used;
+    std::copy(str.begin(), str.end(), at);
+    used += str.size();
+    return { at, str.size() };
+  }
+
+  std::vector<std::unique_ptr<char[]>> chunks;
+  size_t used = CHUNK;
+  std::vector<std::string_view> views;
+  std::vector<std::uint32_t> hashes;
+  std::vector<std::uint32_t> slots = std::vector<std::uint32_t>(64, NONE);
+};
+
+// A string interned in the global StringPool, held as its 4 byte id.
+struct FlyString {
+  FlyString() {}
+  FlyString(std::string_view str) : id(StringPool::global().intern(str)) {}
+
+  // The already interned `str`, or nothing. Never adds to the pool.
+  static std::optional<FlyString> find(std::string_view str) {
+    const auto id = StringPool::global().lookup(str);
+    if (!id) return {};
+    FlyString out;
+    out.id = *id;
+    return out;
+  }
+
+  std::string_view val() const { if (id == StringPool::NONE) throw std::runtime_error("Uninitialised FlyString accessed"); return StringPool::global()[id]; }
+  explicit operator std::string_view() const { return val(); }
+  std::string_view operator*() const { return val(); }
+
+  bool operator==(const FlyString& x) const {
+    return id == x.id;
+  }
+
+  bool operator==(std::string_view x) const {
+    return id != StringPool::NONE && val() == x;
+  }
+
+  std::uint32_t id = StringPool::NONE;
+};
+
+template <>
+struct std::hash<FlyString> {
+  size_t operator()(const FlyString& k) const {
+    return k.id;
   }
 };
 
-using FlyString = FlyResource<std::string>;
+using SharedFlyString = FlyResource<std::string, FlyShardedPool<std::string>>;
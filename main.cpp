@@ -1,4 +1,5 @@
 #define BASE_TEST_REGEX
+#define BASE_TEST_FLY
 #include "test.hpp"
 
 int main(int argc, char** argv) {
@@ -1,12 +1,41 @@
 #pragma once
 #include <algorithm>
+#include <array>
+#include <barrier>
+#include <bit>
+#include <cstdio>
+#include <cstring>
 #include <cstdint>
 #include <functional>
+#include <initializer_list>
 #include <iterator>
+#include <limits>
+#include <memory>
+#include <memory_resource>
 #include <numeric>
+#include <optional>
+#include <span>
+#include <stdexcept>
+#include <string>
 #include <string_view>
+#include <thread>
+#include <type_traits>
+#include <utility>
 #include <unordered_set>
 #include <vector>
+#if defined(__SSE2__) || defined(__x86_64__)
+#include <immintrin.h>
+#endif
+#ifdef REGEX_STATS
+#include <atomic>
+#include <chrono>
+#endif
+#if __has_include(<sys/mman.h>)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 typedef uint64_t u64; typedef int64_t i64;
 typedef uint32_t u32; typedef int32_t i32;
 typedef uint16_t u16; typedef int16_t i16;
@@ -14,150 +43,1166 @@ typedef uint8_t u8;   typedef int8_t i8;
 
 struct Location { i32 start; i32 end; };
 
-template <>
-struct std::hash<std::unordered_set<i32>> {
-  std::size_t operator()(const std::unordered_set<i32>& k) const {
-    return std::reduce(k.begin(), k.end(), 0, [](auto acc, auto x){ return acc + x; });
+// What tokenize does with bytes that start no token: stop there, or emit
+// them as a T_NULL token (consecutive bytes coalesced) and carry on.
+enum class Recovery { Stop, Skip };
+
+// How a DFA state reached by several tagged NFA states picks its tag: fold
+// them all with TF, or take the lowest numbered one, i.e. the earliest rule.
+enum class Priority { Fold, Order };
+
+// Structure of arrays token stream, tags[k] spans [starts[k], ends[k]).
+template <typename T>
+struct Tokens {
+  std::vector<T> tags;
+  std::vector<i32> starts;
+  std::vector<i32> ends;
+
+  size_t size() const { return tags.size(); }
+  void clear() { tags.clear(); starts.clear(); ends.clear(); }
+  void push_back(T t, i32 start, i32 end) {
+    tags.push_back(t);
+    starts.push_back(start);
+    ends.push_back(end);
+  }
+};
+
+// The longest match from `i` of a DFA walked a byte at a time from `curr`,
+// as { tag, end }, or { T_NULL, i }. advance(s, j) is the state after byte
+// j, or `dead`, and may move j on over bytes that leave that state where it
+// is; accepts(s) and tag(s) read a live state. Sets `reach` past the last
+// byte read: the one the walk died on, or n, which counts as one more.
+template <typename T, T T_NULL>
+constexpr std::pair<T, i32> maximalMunch(i32 i, i32 n, i32 curr, i32 dead, auto&& advance, auto&& accepts, auto&& tag, i32& reach) {
+  std::pair<T, i32> out = { T_NULL, i };
+  auto j = i;
+  for (; j < n; ++j) {
+    curr = advance(curr, j);
+    if (curr == dead) break;
+    if (accepts(curr)) out = { tag(curr), j + 1 };
+  }
+  reach = j + 1;
+  return out;
+}
+
+// Lexes one token at `i` onto `out` given munch(i) -> { tag, end }, or under
+// Recovery::Skip one unmatched byte, run together with unmatched bytes just
+// before it into one T_NULL token. Returns the next offset, or `i` if
+// Recovery::Stop hit a byte that starts no token.
+template <typename T, T T_NULL>
+i32 munchStep(i32 i, Tokens<T>& out, Recovery recovery, auto&& munch) {
+  const auto [tag, end] = munch(i);
+  if (end != i) {
+    out.push_back(tag, i, end);
+    return end;
+  }
+  if (recovery == Recovery::Stop) return i;
+  if (out.size() && out.tags.back() == T_NULL && out.ends.back() == i) ++out.ends.back();
+  else out.push_back(T_NULL, i, i + 1);
+  return i + 1;
+}
+
+// munchStep from `from` until a token would start at or after `to`. Returns
+// where lexing stopped. The last token may run past `to`.
+template <typename T, T T_NULL>
+i32 munchUntil(i32 from, i32 to, Tokens<T>& out, Recovery recovery, auto&& munch) {
+  auto i = from;
+  while (i < to) {
+    const auto next = munchStep<T, T_NULL>(i, out, recovery, munch);
+    if (next == i) break;
+    i = next;
+  }
+  return i;
+}
+
+// Build with REGEX_STATS to have RegexLexer record what its automata cost
+// and what matching with them does. Without it REGEX_STAT drops its
+// argument and none of the counters exist.
+#ifdef REGEX_STATS
+#define REGEX_STAT(...) __VA_ARGS__
+
+struct RegexBuildStats {
+  i32 nfaStates = 0;
+  i32 nfaEdges = 0;
+  i32 dfaStates = 0;
+  i32 minimisedStates = 0;
+  // Non-dead cells of the final table.
+  i32 transitions = 0;
+  // Most subset states found but not yet expanded at once during dfa().
+  i32 subsetPeak = 0;
+  // Splitters processed by minimise(), or refinement passes of minimiseNaive().
+  i32 minimiseRounds = 0;
+  u64 tableBytes = 0;
+  // The keyword table set by withKeywords().
+  u64 keywordBytes = 0;
+  double dfaMs = 0;
+  double minimiseMs = 0;
+};
+
+// Shared by every thread matching through one lexer, hence atomic.
+struct RegexMatchStats {
+  std::atomic<u64> bytes = 0;
+  std::atomic<u64> tokens = 0;
+  // Bytes munch walked past the end of the token it returned.
+  std::atomic<u64> backtrack = 0;
+};
+
+// Milliseconds on a steady clock, or 0 in a constant expression.
+constexpr double statsClock() {
+  if (std::is_constant_evaluated()) return 0;
+  return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+#else
+#define REGEX_STAT(...)
+#endif
+
+// Acceleration for a DFA state that loops on itself for most input: scan
+// Until the first byte in `bytes`, or While bytes are in it, instead of
+// stepping the table one byte at a time.
+struct Accel {
+  enum Mode : u8 { None, Until, While };
+  Mode mode;
+  u8 count;
+  u8 bytes[4];
+
+  // Bytes checked one at a time before a vector scan is worth setting up.
+  static constexpr i32 SHORT = 16;
+
+  // First index in [i, n) whose byte leaves the state, or n. Most runs in
+  // ordinary text are a few bytes long, so the first SHORT are checked
+  // inline and only a run outlasting them pays for the vector scan.
+  constexpr i32 scan(const char* p, i32 i, i32 n) const {
+    const auto stop = n - i > SHORT ? i + SHORT : n;
+    for (; i < stop; ++i) {
+      if (leaves(static_cast<u8>(p[i]))) return i;
+    }
+    if (i == n) return n;
+    return std::is_constant_evaluated() ? scanScalar(*this, p, i, n) : scanImpl()(*this, p, i, n);
+  }
+
+  constexpr bool leaves(u8 c) const {
+    const bool hit = c == bytes[0] || c == bytes[1] || c == bytes[2] || c == bytes[3];
+    return hit == (mode == Until);
+  }
+
+  constexpr static i32 scanScalar(const Accel& a, const char* p, i32 i, i32 n) {
+    for (; i < n; ++i) {
+      if (a.leaves(static_cast<u8>(p[i]))) break;
+    }
+    return i;
+  }
+
+#if defined(__SSE2__)
+  static i32 scanSSE2(const Accel& a, const char* p, i32 i, i32 n) {
+    __m128i b[4];
+    for (auto k = 0; k < 4; ++k) b[k] = _mm_set1_epi8(static_cast<char>(a.bytes[k]));
+    const u32 flip = a.mode == Until ? 0 : 0xffff;
+    for (; i + 16 <= n; i += 16) {
+      const auto v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + i));
+      const auto eq = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, b[0]), _mm_cmpeq_epi8(v, b[1])),
+                                   _mm_or_si128(_mm_cmpeq_epi8(v, b[2]), _mm_cmpeq_epi8(v, b[3])));
+      const u32 mask = static_cast<u32>(_mm_movemask_epi8(eq)) ^ flip;
+      if (mask) return i + std::countr_zero(mask);
+    }
+    return scanScalar(a, p, i, n);
+  }
+#endif
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+  __attribute__((target("avx2"))) static i32 scanAVX2(const Accel& a, const char* p, i32 i, i32 n) {
+    __m256i b[4];
+    for (auto k = 0; k < 4; ++k) b[k] = _mm256_set1_epi8(static_cast<char>(a.bytes[k]));
+    const u32 flip = a.mode == Until ? 0 : 0xffffffff;
+    for (; i + 32 <= n; i += 32) {
+      const auto v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p + i));
+      const auto eq = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(v, b[0]), _mm256_cmpeq_epi8(v, b[1])),
+                                      _mm256_or_si256(_mm256_cmpeq_epi8(v, b[2]), _mm256_cmpeq_epi8(v, b[3])));
+      const u32 mask = static_cast<u32>(_mm256_movemask_epi8(eq)) ^ flip;
+      if (mask) return i + std::countr_zero(mask);
+    }
+    return scanScalar(a, p, i, n);
+  }
+#endif
+
+  using scan_t = i32 (*)(const Accel&, const char*, i32, i32);
+  static scan_t pickScan() {
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+    if (__builtin_cpu_supports("avx2")) return scanAVX2;
+#endif
+#if defined(__SSE2__)
+    return scanSSE2;
+#else
+    return scanScalar;
+#endif
+  }
+  // Picked on first use rather than by a static initialiser, which a match
+  // run from another translation unit's initialiser could come before.
+  static scan_t scanImpl() {
+    static const scan_t impl = pickScan();
+    return impl;
   }
 };
 
 template <typename T>
-concept mvectorable = requires { requires sizeof(T) <= sizeof(T*); };
+concept mvectorable = std::is_trivially_copyable_v<T>;
 
-template <mvectorable T>
+// Vector that keeps its first N elements inline and only allocates from
+// Alloc once it outgrows them. Fragment accept lists, the common case, are
+// one to a few states long.
+template <mvectorable T, size_t N = 1, typename Alloc = std::allocator<T>>
 struct mvector {
-  mvector(const mvector& x) : data(nullptr) { *this = x; }
-  mvector(mvector&& x) { *this = std::move(x); }
-  mvector& operator=(const mvector& x) {
-    if (hasData()) free(data);
-    _capacity = x._capacity;
+  static_assert(N > 0, "mvector needs room for at least one inline element");
+  using value_type = T;
+  using iterator = T*;
+  using const_iterator = const T*;
+  using traits = std::allocator_traits<Alloc>;
+
+  constexpr mvector(const Alloc& alloc = Alloc()) : alloc(alloc), data(local), _size(0), _capacity(N) {}
+  constexpr mvector(T val) : mvector() { push_back(val); }
+  constexpr mvector(std::initializer_list<T> xs) : mvector() {
+    reserve(xs.size());
+    for (const auto x : xs) data[_size++] = x;
+  }
+  constexpr mvector(const mvector& x) : mvector(traits::select_on_container_copy_construction(x.alloc)) { *this = x; }
+  constexpr mvector(mvector&& x) : mvector(x.alloc) { *this = std::move(x); }
+  constexpr ~mvector() { release(); }
+
+  constexpr mvector& operator=(const mvector& x) {
+    if (this == &x) return *this;
+    _size = 0;
+    reserve(x._size);
+    std::copy(x.data, x.data + x._size, data);
     _size = x._size;
-    if (x.hasValue()) val = x.val;
-    else {
-      data = static_cast<T*>(malloc(x._capacity * sizeof(T)));
-      memcpy(data, x.data, x._size * sizeof(T));
-    }
     return *this;
   }
-  mvector& operator=(mvector&& x) {
-    if (this != &x) {
-      if (hasData()) free(data);
-      data = x.data;
-      _capacity = x._capacity;
-      _size = x._size;
-      x.data = nullptr;
+  // Steals a heap block when the allocators agree; inline elements, or
+  // blocks another allocator has to free, are copied.
+  constexpr mvector& operator=(mvector&& x) {
+    if (this == &x) return *this;
+    if (x.isInline() || !(alloc == x.alloc)) {
+      *this = std::as_const(x);
+      x._size = 0;
+      return *this;
     }
+    release();
+    data = std::exchange(x.data, x.local);
+    _capacity = std::exchange(x._capacity, N);
+    _size = std::exchange(x._size, 0);
     return *this;
   }
-  static const size_t INITIAL_CAPACITY = 1;
-  mvector()
-      : data(INITIAL_CAPACITY ? static_cast<T*>(malloc(INITIAL_CAPACITY * sizeof(T))) : nullptr), _capacity(INITIAL_CAPACITY), _size(0) {}
-  ~mvector() { if (hasData()) free(data); }
-  mvector(T val) : val(val), _capacity(std::numeric_limits<size_t>::max()) {}
-  void push_back(T val) {
-    if (_size == _capacity) expand();
+
+  constexpr void push_back(T val) {
+    if (_size == _capacity) reserve(_capacity * 2);
     data[_size++] = val;
   }
-  bool hasData() const { return !hasValue(); }
-  bool hasValue() const { return _capacity == std::numeric_limits<size_t>::max(); }
-  void expand() {
-    const size_t ncap = (!_capacity + _capacity) * 2;
-    const auto allocSize = ncap * sizeof(T);
-    T* ndata = static_cast<T*>(realloc(data, allocSize));
-    if (!ndata) {
-      ndata = static_cast<T*>(malloc(allocSize));
-      memcpy(ndata, data, sizeof(T) * _size);
-      free(data);
-    }
+  constexpr void reserve(size_t n) {
+    if (n <= _capacity) return;
+    T* ndata = traits::allocate(alloc, n);
+    std::copy(data, data + _size, ndata);
+    release();
     data = ndata;
-    _capacity = ncap;
-  }
-  size_t size() const { return _size; }
-  struct iterator {
-    using difference_type = std::ptrdiff_t;
-    using element_type = T;
-
-    iterator(T* ptr) : ptr(ptr) {}
-    T& operator*() const { return *ptr; }
-    auto& operator++() { ptr++; return *this; }
-    auto operator++(int) { auto tmp = *this; ++(*this); return tmp; }
-    auto operator<=>(const iterator&) const = default;
-    T* ptr;
-  };
+    _capacity = n;
+  }
+  // Frees a heap block, going back to the inline elements. Contents are
+  // not kept.
+  constexpr void release() {
+    if (!isInline()) traits::deallocate(alloc, data, _capacity);
+    data = local;
+    _capacity = N;
+  }
+  constexpr void clear() { _size = 0; }
+  constexpr bool isInline() const { return data == local; }
+  constexpr size_t size() const { return _size; }
+  constexpr bool empty() const { return !_size; }
+  constexpr T& operator[](size_t i) { return data[i]; }
+  constexpr const T& operator[](size_t i) const { return data[i]; }
+  constexpr T& back() { return data[_size - 1]; }
+
+  constexpr iterator begin() { return data; }
+  constexpr iterator end() { return data + _size; }
+  constexpr const_iterator begin() const { return data; }
+  constexpr const_iterator end() const { return data + _size; }
 
-  iterator begin() const { return iterator(data); }
-  iterator end() const { return iterator(&data[_size]); }
-  union { T* data; T val; };
+  [[no_unique_address]] Alloc alloc;
+  T* data;
   size_t _size;
   size_t _capacity;
+  T local[N] = {};
+};
+
+// An mvector that spills into a std::pmr resource, e.g. a
+// monotonic_buffer_resource used as a builder arena: pass the resource to
+// the constructor. Moves between vectors on the same resource steal blocks.
+template <mvectorable T, size_t N = 1>
+using pmr_mvector = mvector<T, N, std::pmr::polymorphic_allocator<T>>;
+
+// Every NFA edge in one arena. A state's edges form a list threaded through
+// `edges` newest first, so adding an edge, a state or a whole fragment only
+// ever appends to the two vectors. An edge covers the bytes [lo, hi]; lo 0
+// marks an epsilon edge.
+struct EdgeArena {
+  struct Edge { u8 lo; u8 hi; i32 to; i32 next; };
+
+  constexpr i32 size() const { return head.size(); }
+  constexpr void addState() { head.push_back(-1); }
+  constexpr void add(i32 from, char c, i32 to) { add(from, c, c, to); }
+  constexpr void add(i32 from, u8 lo, u8 hi, i32 to) {
+    edges.push_back({ lo, hi, to, head[from] });
+    head[from] = edges.size() - 1;
+  }
+
+  // Appends the states of `x`, renumbered to follow ours.
+  constexpr void append(const EdgeArena& x) {
+    const i32 states = size(), base = edges.size();
+    head.reserve(head.size() + x.head.size());
+    edges.reserve(edges.size() + x.edges.size());
+    for (const auto h : x.head) head.push_back(h == -1 ? -1 : h + base);
+    for (const auto& e : x.edges) edges.push_back({ e.lo, e.hi, e.to + states, e.next == -1 ? -1 : e.next + base });
+  }
+
+  // Calls f(lo, hi, to) for each of `q`'s edges.
+  constexpr void each(i32 q, auto&& f) const {
+    for (auto e = head[q]; e != -1; e = edges[e].next) f(edges[e].lo, edges[e].hi, edges[e].to);
+  }
+
+  constexpr void clear() {
+    head.clear();
+    edges.clear();
+  }
+
+  std::vector<i32> head;
+  std::vector<Edge> edges;
+};
+
+// FNV-1a, used for image checksums and grammar fingerprints.
+constexpr u64 fnv1a(const std::string_view& bytes, u64 h = 0xcbf29ce484222325ull) {
+  for (const auto c : bytes) h = (h ^ static_cast<u8>(c)) * 0x100000001b3ull;
+  return h;
+}
+
+// Layout of a file written by RegexLexer::save and mapped by RegexImage, in
+// native byte order. Section offsets are from the start of the file and 64
+// byte aligned; `checksum` covers everything from the first section on.
+struct RegexImageHeader {
+  static constexpr char MAGIC[8] = { 'R', 'E', 'G', 'E', 'X', 'L', 'E', 'X' };
+  static constexpr u32 VERSION = 1;
+  static constexpr u64 BODY = 128;
+
+  char magic[8];
+  u32 version;
+  u32 tagSize;
+  u64 fingerprint;
+  u64 checksum;
+  u64 size;
+  i32 classes;
+  i32 dead;
+  i32 start;
+  i32 alphabetSize;
+  u64 table;
+  u64 states;
+  u64 accepting;
+  u64 accel;
+  u64 byteClass;
+  u64 alphabet;
+};
+static_assert(sizeof(RegexImageHeader) <= RegexImageHeader::BODY);
+
+// Open addressed set of fixed width bitset rows, numbered in insertion order.
+struct BitsetTable {
+  constexpr BitsetTable(i32 words) : words(words), slots(64, -1) {}
+
+  constexpr i32 size() const { return rows.size() / words; }
+  constexpr const u64* operator[](i32 i) const { return &rows[i * words]; }
+
+  // Returns the id of `row` and whether it was added by this call.
+  constexpr std::pair<i32, bool> insert(const u64* row) {
+    const i32 count = size();
+    if (count * 2 >= slots.size()) {
+      slots.assign(slots.size() * 2, -1);
+      for (i32 i = 0; i < count; ++i) slots[slot((*this)[i])] = i;
+    }
+    auto& found = slots[slot(row)];
+    if (found != -1) return { found, false };
+    found = count;
+    rows.insert(rows.end(), row, row + words);
+    return { found, true };
+  }
+
+  // Id of `row`, or -1.
+  constexpr i32 find(const u64* row) const { return slots[slot(row)]; }
+
+  constexpr void clear() {
+    rows.clear();
+    std::fill(slots.begin(), slots.end(), -1);
+  }
+
+  constexpr u64 hash(const u64* row) const {
+    u64 h = words;
+    for (i32 w = 0; w < words; ++w) {
+      h = (h ^ row[w]) * 0x9e3779b97f4a7c15ull;
+      h ^= h >> 29;
+    }
+    return h ^ (h >> 32);
+  }
+
+  constexpr size_t slot(const u64* row) const {
+    const auto mask = slots.size() - 1;
+    for (auto h = hash(row) & mask;; h = (h + 1) & mask) {
+      if (slots[h] == -1 || std::equal(row, row + words, &rows[slots[h] * words])) return h;
+    }
+  }
+
+  i32 words;
+  std::vector<u64> rows;
+  std::vector<i32> slots;
+};
+
+// Keywords looked up after matching instead of lexed by the DFA: it then
+// holds one rule, e.g. identifiers, rather than a branch per keyword copying
+// that rule's transitions. Tokens the `from` rule tags are looked up here and
+// retagged if they are a keyword. Lookup is one probe of a hash and displace
+// perfect hash: keys are hashed into buckets, and each bucket, largest first,
+// gets the first displacement that sends all of its keys to free slots.
+//
+// The DFA shrinks, but every `from` token pays for a lookup. Tokens whose
+// length or last byte no keyword has are turned away first; the rest are
+// hashed and compared. So this only lexes faster when the keyword rules
+// would have pushed the table out of cache.
+template <typename T, T T_NULL>
+struct KeywordTable {
+  constexpr KeywordTable() {}
+
+  // Every keyword should be matched whole by the `from` rule. The first of
+  // any repeated keyword wins.
+  constexpr KeywordTable(std::span<const std::pair<std::string_view, T>> keywords, T from) : from(from) {
+    std::vector<i32> order(keywords.size());
+    std::iota(order.begin(), order.end(), 0);
+    std::sort(order.begin(), order.end(), [&](i32 a, i32 b) { return std::pair(keywords[a].first, a) < std::pair(keywords[b].first, b); });
+    order.erase(std::unique(order.begin(), order.end(), [&](i32 a, i32 b) { return keywords[a].first == keywords[b].first; }), order.end());
+    std::vector<std::pair<std::string_view, T>> keys;
+    for (const auto k : order) keys.push_back(keywords[k]);
+    if (keys.empty()) return;
+
+    for (const auto& [key, tag] : keys) {
+      lengths |= u64(1) << std::min<size_t>(key.size(), 63);
+      if (key.size()) lasts[static_cast<u8>(key.back()) >> 6] |= u64(1) << (key.back() & 63);
+    }
+    slots.assign(std::bit_ceil(keys.size() * 2), { 0, 0, T_NULL });
+    displace.assign(keys.size() / 4 + 1, 0);
+    std::vector<std::vector<i32>> buckets(displace.size());
+    for (i32 k = 0; k < keys.size(); ++k) buckets[bucket(hash(keys[k].first))].push_back(k);
+    std::vector<i32> fill(buckets.size());
+    std::iota(fill.begin(), fill.end(), 0);
+    std::sort(fill.begin(), fill.end(), [&](i32 a, i32 b) { return std::pair(buckets[a].size(), b) > std::pair(buckets[b].size(), a); });
+
+    std::vector<u8> used(slots.size());
+    std::vector<size_t> tried;
+    for (const auto b : fill) {
+      if (buckets[b].empty()) break;
+      for (u32 d = 0;; ++d) {
+        tried.clear();
+        for (const auto k : buckets[b]) {
+          const auto i = slot(hash(keys[k].first), d);
+          if (used[i] || std::find(tried.begin(), tried.end(), i) != tried.end()) break;
+          tried.push_back(i);
+        }
+        if (tried.size() < buckets[b].size()) continue;
+        displace[b] = d;
+        for (auto j = 0; j < tried.size(); ++j) {
+          const auto& [key, tag] = keys[buckets[b][j]];
+          used[tried[j]] = true;
+          slots[tried[j]] = { static_cast<u32>(text.size()), static_cast<u32>(key.size()), tag };
+          text += key;
+        }
+        break;
+      }
+    }
+  }
+
+  // The keyword's tag, or T_NULL if `str` is not one.
+  constexpr T find(const std::string_view& str) const {
+    if (!((lengths >> std::min<size_t>(str.size(), 63)) & 1)) return T_NULL;
+    if (str.size() && !((lasts[static_cast<u8>(str.back()) >> 6] >> (str.back() & 63)) & 1)) return T_NULL;
+    const auto h = hash(str);
+    const auto& x = slots[slot(h, displace[bucket(h)])];
+    return x.tag != T_NULL && x.length == str.size() && std::equal(str.begin(), str.end(), text.begin() + x.offset) ? x.tag : T_NULL;
+  }
+
+  // `tag` for the token `str`, retagged if it is a keyword.
+  constexpr T retag(T tag, const std::string_view& str) const {
+    if (tag != from) return tag;
+    const auto found = find(str);
+    return found == T_NULL ? tag : found;
+  }
+
+  constexpr bool empty() const { return slots.empty(); }
+  constexpr u64 bytes() const { return text.size() + slots.size() * sizeof(Slot) + displace.size() * sizeof(u32); }
+
+  T from = T_NULL;
+
+private:
+  struct Slot { u32 offset; u32 length; T tag; };
+
+  // Eight bytes to a multiply, where fnv1a takes one per byte; the shifts
+  // in `word` compile to a single load.
+  static constexpr u64 hash(const std::string_view& str) {
+    constexpr u64 K = 0x9e3779b97f4a7c15ull;
+    const auto word = [&](size_t at, size_t count) {
+      u64 w = 0;
+      for (size_t b = 0; b < count; ++b) w |= u64(static_cast<u8>(str[at + b])) << (8 * b);
+      return w;
+    };
+    u64 h = str.size() * K;
+    size_t i = 0;
+    for (; i + 8 <= str.size(); i += 8) h = (h ^ word(i, 8)) * K;
+    h = (h ^ word(i, str.size() - i)) * K;
+    return h ^ (h >> 29);
+  }
+
+  // Multiply-shift rather than a modulo, which would cost a division.
+  constexpr size_t bucket(u64 h) const { return ((h >> 32) * displace.size()) >> 32; }
+  constexpr size_t slot(u64 h, u32 d) const {
+    h ^= d * 0x9e3779b97f4a7c15ull;
+    h = (h ^ (h >> 33)) * 0xff51afd7ed558ccdull;
+    return (h ^ (h >> 33)) & (slots.size() - 1);
+  }
+
+  std::string text;
+  std::vector<Slot> slots;
+  std::vector<u32> displace;
+  // Bit k set if a keyword is k bytes long, bit 63 for 63 or more.
+  u64 lengths = 0;
+  // Bit b set if a keyword ends in byte b.
+  u64 lasts[4] = {};
+};
+
+// Non-owning view of a compiled DFA: everything the match loops need. The
+// tables may live in a RegexLexer's vectors or in a mapped RegexImage.
+template <typename T, T T_NULL>
+struct RegexView {
+  constexpr T match(const std::string_view& str) const {
+    return match(str, 0).first;
+  }
+
+  constexpr std::pair<T, Location> match(const std::string_view& str, i32 i) const {
+    auto curr = start;
+    Location loc = { .start = i, .end = i };
+    if (i >= str.length()) return { T_NULL, loc };
+    const auto* t = table;
+    const auto* cls = byteClass;
+    const auto* p = str.data();
+    const i32 n = str.length();
+    auto j = i;
+    for (; j < n; ++j) {
+      const auto next = t[curr * classes + cls[static_cast<u8>(p[j])]];
+      if (next == dead) break;
+      if (next == curr && accel[curr].mode) j = accel[curr].scan(p, j + 1, n) - 1;
+      curr = next;
+    }
+    loc.end = j;
+    REGEX_STAT(if (stats && !std::is_constant_evaluated()) stats->bytes += j - i;)
+    if (keywords) return { keywords->retag(states[curr], str.substr(i, j - i)), loc };
+    return { states[curr], loc };
+  }
+
+  // match(str) for each of `strs` into `out`. Each walk is a chain of
+  // dependent table loads, so LANES independent ones are stepped a byte at a
+  // time in turn, each lane taking the next string when its own is done, and
+  // the loads of one overlap the others' latency.
+  void matchMany(std::span<const std::string_view> strs, std::span<T> out) const {
+    constexpr i32 LANES = 16;
+    struct Lane { const char* p; const char* e; i32 curr; size_t k; };
+    Lane lanes[LANES];
+    const auto* t = table;
+    const auto* cls = byteClass;
+    size_t next = 0;
+    REGEX_STAT(u64 bytes = 0;)
+    // Points `x` at the next non-empty string, or returns false if none are left.
+    const auto refill = [&](Lane& x) {
+      for (; next < strs.size(); ++next) {
+        if (strs[next].empty()) {
+          out[next] = T_NULL;
+          continue;
+        }
+        x = { strs[next].data(), strs[next].data() + strs[next].size(), start, next };
+        ++next;
+        return true;
+      }
+      return false;
+    };
+    i32 live = 0;
+    while (live < LANES && refill(lanes[live])) ++live;
+    while (live) {
+      for (i32 l = 0; l < live;) {
+        auto& x = lanes[l];
+        const auto n = t[x.curr * classes + cls[static_cast<u8>(*x.p)]];
+        if (n != dead) {
+          x.curr = n;
+          if (++x.p != x.e) {
+            ++l;
+            continue;
+          }
+        }
+        out[x.k] = states[x.curr];
+        if (keywords) out[x.k] = keywords->retag(out[x.k], strs[x.k].substr(0, x.p - strs[x.k].data()));
+        REGEX_STAT(bytes += x.p - strs[x.k].data();)
+        if (!refill(x)) x = lanes[--live];
+      }
+    }
+    REGEX_STAT(if (stats) stats->bytes += bytes;)
+  }
+
+  // Longest match from `i`: the tag and end of the last accepting state the
+  // walk passed through, or { T_NULL, i } if there was none.
+  constexpr std::pair<T, i32> munch(const std::string_view& str, i32 i) const {
+    i32 reach;
+    return munch(str, i, reach);
+  }
+
+  // As above, also setting `reach` past the last byte the walk read: the one
+  // it died on, or the end of `str`, which counts as one more.
+  constexpr std::pair<T, i32> munch(const std::string_view& str, i32 i, i32& reach) const {
+    const auto* p = str.data();
+    const i32 n = str.size();
+    auto out = maximalMunch<T, T_NULL>(i, n, start, dead,
+      [&](i32 s, i32& j) { return advance(s, p, j, n); },
+      [&](i32 s) { return accepting[s]; },
+      [&](i32 s) { return states[s]; }, reach);
+    REGEX_STAT(if (stats && !std::is_constant_evaluated()) {
+      stats->bytes += reach - 1 - i;
+      stats->backtrack += reach - 1 - out.second;
+    })
+    if (keywords && out.second != i) out.first = keywords->retag(out.first, str.substr(i, out.second - i));
+    return out;
+  }
+
+  // The state after byte `j` of `p` from `s`, or `dead`. Where `s` loops on
+  // that byte and is accelerated, `j` is moved on to the last byte before
+  // one leaving it. Only looking once a state has looped keeps the check
+  // off steps between states, which is most of them in ordinary text.
+  constexpr i32 advance(i32 s, const char* p, i32& j, i32 n) const {
+    const auto next = table[s * classes + byteClass[static_cast<u8>(p[j])]];
+    if (next == s && accel[s].mode) j = accel[s].scan(p, j + 1, n) - 1;
+    return next;
+  }
+
+  Tokens<T> tokenize(const std::string_view& str, Recovery recovery = Recovery::Stop) const {
+    Tokens<T> out;
+    tokenize(str, out, recovery);
+    return out;
+  }
+
+  // Appends the maximal munch tokenisation of `str` to `out`. Returns the
+  // offset lexing stopped at, which is str.length() unless Recovery::Stop hit
+  // a byte that starts no token.
+  i32 tokenize(const std::string_view& str, Tokens<T>& out, Recovery recovery = Recovery::Stop) const {
+    return tokenize(str, out, recovery, 0, str.length());
+  }
+
+  // As above, but starting at `from` and stopping before the first token that
+  // would start at or after `to`. The last token may run past `to`.
+  i32 tokenize(const std::string_view& str, Tokens<T>& out, Recovery recovery, i32 from, i32 to) const {
+    REGEX_STAT(const auto before = out.size();)
+    const auto i = munchUntil<T, T_NULL>(from, to, out, recovery, [&](i32 i) { return munch(str, i); });
+    REGEX_STAT(if (stats) stats->tokens += out.size() - before;)
+    return i;
+  }
+
+  // Same result as tokenize(), lexed on up to `threads` threads. Each chunk
+  // is lexed speculatively from the start state as though a token began at
+  // its first byte. Chunks are then stitched in order: from wherever the
+  // previous chunk's last token really ended, lexing continues sequentially
+  // until it reaches a token start of the speculative run, and the rest of
+  // that run is taken as is. Maximal munch from a token boundary does not
+  // depend on what came before it, so the runs usually line up within a
+  // token or two.
+  Tokens<T> tokenizeParallel(const std::string_view& str, Recovery recovery = Recovery::Stop,
+                             i32 threads = std::thread::hardware_concurrency()) const {
+    constexpr i32 minChunk = 1 << 16;
+    const i32 n = str.length();
+    const i32 k = std::clamp(n / minChunk, 1, std::max(threads, 1));
+    if (k == 1) return tokenize(str, recovery);
+
+    struct Chunk { Tokens<T> tokens; i32 end; i32 next; };
+    std::vector<Chunk> chunks(k);
+    {
+      const auto run = [&](i32 c) {
+        auto& chunk = chunks[c];
+        chunk.end = i64(n) * (c + 1) / k;
+        chunk.next = tokenize(str, chunk.tokens, recovery, i64(n) * c / k, chunk.end);
+      };
+      std::vector<std::thread> pool;
+      for (i32 c = 1; c < k; ++c) pool.emplace_back(run, c);
+      run(0);
+      for (auto& t : pool) t.join();
+    }
+
+    // A chunk that stopped short of its end hit Recovery::Stop.
+    auto out = std::move(chunks[0].tokens);
+    auto pos = chunks[0].next;
+    for (i32 c = 1; c < k && pos >= chunks[c - 1].end; ++c) {
+      const auto& x = chunks[c].tokens;
+      while (pos < chunks[c].end) {
+        auto t = std::lower_bound(x.starts.begin(), x.starts.end(), pos) - x.starts.begin();
+        if (t < x.size() && x.starts[t] == pos) {
+          if (x.tags[t] == T_NULL && out.size() && out.tags.back() == T_NULL && out.ends.back() == pos) {
+            out.ends.back() = x.ends[t++];
+          }
+          out.tags.insert(out.tags.end(), x.tags.begin() + t, x.tags.end());
+          out.starts.insert(out.starts.end(), x.starts.begin() + t, x.starts.end());
+          out.ends.insert(out.ends.end(), x.ends.begin() + t, x.ends.end());
+          pos = chunks[c].next;
+          break;
+        }
+        const auto next = munchStep<T, T_NULL>(pos, out, recovery, [&](i32 i) { return munch(str, i); });
+        if (next == pos) return out;
+        pos = next;
+      }
+    }
+    return out;
+  }
+
+  const i32* table;
+  const T* states;
+  const u8* accepting;
+  const Accel* accel;
+  const u8* byteClass;
+  i32 classes;
+  i32 dead;
+  i32 start;
+  REGEX_STAT(RegexMatchStats* stats = nullptr;)
+  const KeywordTable<T, T_NULL>* keywords = nullptr;
+};
+
+// Keeps a token stream in step with a buffer edited in place. Next to each
+// token it keeps how far munch read to find it, so after an edit only the
+// tokens whose read touched the edited bytes are lexed again, and lexing
+// stops at the first new token boundary past the edit that an old token
+// also starts at: everything from there on was lexed from unchanged bytes.
+//
+// Tokens sit in a gap buffer with the gap at the last edit. Those before it
+// hold their offsets as they are, those after it relative to the end of the
+// buffer, so an edit moves neither them nor their offsets. Before the gap
+// each token also keeps the furthest read of it and all before it, which
+// only grows, so the first token an edit affects is a binary search. An
+// edit costs the tokens lexed again, a log, and moving the gap from the
+// last edit, which is nothing while typing in one place.
+template <typename T, T T_NULL>
+struct IncrementalLexer {
+  IncrementalLexer(RegexView<T, T_NULL> view, Recovery recovery = Recovery::Skip) : view(view), recovery(recovery) {}
+
+  void lex(const std::string_view& str) {
+    Tokens<T> fresh;
+    std::vector<i32> reaches;
+    lexUntil(str, 0, str.length(), fresh, reaches);
+    entries.clear();
+    gapStart = gapEnd = 0;
+    length = str.length();
+    insert(fresh, reaches);
+  }
+
+  // `str` is the buffer after `removed` bytes at `at` were replaced with
+  // `inserted` new ones. Returns the range of token indices that changed.
+  // Throws std::invalid_argument if that edit doesn't fit the buffer lexed
+  // last, or doesn't give one as long as `str`.
+  std::pair<i32, i32> edit(const std::string_view& str, i32 at, i32 removed, i32 inserted) {
+    if (at < 0 || removed < 0 || inserted < 0 || at + removed > length || length - removed + inserted != str.length()) {
+      throw std::invalid_argument("edit does not match the buffer");
+    }
+    // Tokens from p on start at or after the edit.
+    const auto p = first(0, size(), [&](i32 t) { return start(t) >= at; });
+    moveGap(p);
+    i32 k = std::partition_point(entries.begin(), entries.begin() + gapStart, [&](const Entry& e) { return e.peak <= at; }) - entries.begin();
+    const auto from = k < size() ? start(k) : size() ? end(size() - 1) : 0;
+
+    // From here on the tokens after the gap are at their new offsets. Those
+    // from `m` on started after the removed bytes.
+    length = str.length();
+    Tokens<T> fresh;
+    std::vector<i32> freshReach;
+    auto m = first(p, size(), [&](i32 t) { return start(t) >= at + inserted; });
+    auto synced = false;
+    for (auto i = from; i < length;) {
+      const auto next = lexUntil(str, i, i + 1, fresh, freshReach);
+      if (next == i) break;
+      i = next;
+      if (i < at + inserted) continue;
+      while (m < size() && start(m) < i) ++m;
+      if (m == size() || start(m) != i) continue;
+      // Unmatched bytes either side of the seam make one T_NULL token.
+      if (fresh.tags.back() == T_NULL && tag(m) == T_NULL) {
+        fresh.ends.back() = end(m);
+        freshReach.back() = std::max(freshReach.back(), reach(m));
+        ++m;
+      }
+      synced = true;
+      break;
+    }
+    if (!synced) m = size();
+    if (fresh.size() && fresh.tags[0] == T_NULL && k && tag(k - 1) == T_NULL && end(k - 1) == fresh.starts[0]) {
+      --k;
+      fresh.starts[0] = start(k);
+      freshReach[0] = std::max(freshReach[0], reach(k));
+    }
+
+    // Drop [k, m), which straddles the gap, and put the new tokens in it.
+    gapStart = k;
+    gapEnd += m - p;
+    insert(fresh, freshReach);
+    return { k, k + fresh.size() };
+  }
+
+  i32 size() const { return entries.size() - (gapEnd - gapStart); }
+  T tag(i32 t) const { return at(t).tag; }
+  i32 start(i32 t) const { return at(t).start + shift(t); }
+  i32 end(i32 t) const { return at(t).end + shift(t); }
+  // Past the last byte munch read for the token.
+  i32 reach(i32 t) const { return at(t).reach + shift(t); }
+
+  // All of them, as tokenize() would give.
+  Tokens<T> tokens() const {
+    Tokens<T> out;
+    for (i32 t = 0; t < size(); ++t) out.push_back(tag(t), start(t), end(t));
+    return out;
+  }
+
+private:
+  struct Entry {
+    T tag;
+    i32 start;
+    i32 end;
+    i32 reach;
+    // Furthest reach of this token and those before it; kept before the gap.
+    i32 peak;
+  };
+
+  const Entry& at(i32 t) const { return entries[t < gapStart ? t : t + gapEnd - gapStart]; }
+  i32 shift(i32 t) const { return t < gapStart ? 0 : length; }
+
+  // First t in [lo, hi) that `f` holds for, `f` being false then true.
+  static i32 first(i32 lo, i32 hi, auto&& f) {
+    while (lo < hi) {
+      const auto mid = lo + (hi - lo) / 2;
+      if (f(mid)) hi = mid;
+      else lo = mid + 1;
+    }
+    return lo;
+  }
+
+  void moveGap(i32 p) {
+    while (gapStart > p) {
+      auto& e = entries[--gapEnd] = entries[--gapStart];
+      e.start -= length;
+      e.end -= length;
+      e.reach -= length;
+    }
+    while (gapStart < p) {
+      auto& e = entries[gapStart] = entries[gapEnd++];
+      e.start += length;
+      e.end += length;
+      e.reach += length;
+      e.peak = gapStart ? std::max(entries[gapStart - 1].peak, e.reach) : e.reach;
+      ++gapStart;
+    }
+  }
+
+  // Writes `fresh` at the gap, widening it first if it is too narrow.
+  void insert(const Tokens<T>& fresh, const std::vector<i32>& reaches) {
+    const i32 n = fresh.size();
+    if (gapEnd - gapStart < n) {
+      const i32 after = entries.size() - gapEnd;
+      std::vector<Entry> wider(std::max<size_t>(2 * (size() + n), 64));
+      std::copy(entries.begin(), entries.begin() + gapStart, wider.begin());
+      std::copy(entries.begin() + gapEnd, entries.end(), wider.end() - after);
+      entries = std::move(wider);
+      gapEnd = entries.size() - after;
+    }
+    for (i32 j = 0; j < n; ++j, ++gapStart) {
+      const auto peak = gapStart ? std::max(entries[gapStart - 1].peak, reaches[j]) : reaches[j];
+      entries[gapStart] = { fresh.tags[j], fresh.starts[j], fresh.ends[j], reaches[j], peak };
+    }
+  }
+
+  // RegexView::tokenize over [from, to), also noting each token's reach.
+  i32 lexUntil(const std::string_view& str, i32 from, i32 to, Tokens<T>& out, std::vector<i32>& reaches) const {
+    auto i = from;
+    while (i < to) {
+      i32 r;
+      const auto next = munchStep<T, T_NULL>(i, out, recovery, [&](i32 i) { return view.munch(str, i, r); });
+      if (next == i) break;
+      if (reaches.size() < out.size()) reaches.push_back(r);
+      else reaches.back() = std::max(reaches.back(), r);
+      i = next;
+    }
+    return i;
+  }
+
+  RegexView<T, T_NULL> view;
+  Recovery recovery;
+  std::vector<Entry> entries;
+  i32 gapStart = 0;
+  i32 gapEnd = 0;
+  // Of the buffer, which offsets after the gap are relative to.
+  i32 length = 0;
+};
+
+// Lexes input pushed in chunks, e.g. reads off a pipe or socket, into the
+// same tokens tokenize() would give for all of it at once, with 64 bit
+// offsets. The DFA walk carries over from one chunk to the next; the bytes
+// kept are only those since the last accepting state (or the token start),
+// which is as far back as maximal munch can have to back out. Tokens go to
+// `emit(tag, start, end)` as soon as they are known, so a token is only
+// emitted once the byte after it has been seen, or at finish(). Each chunk
+// must be under 2 GB.
+template <typename T, T T_NULL>
+struct StreamLexer {
+  StreamLexer(RegexView<T, T_NULL> view, Recovery recovery = Recovery::Stop) : view(view), recovery(recovery), curr(view.start) {}
+
+  template <typename F>
+  void push(const std::string_view& chunk, F&& emit) {
+    const auto base = end;
+    end += chunk.size();
+    if (!stopped) feed(chunk, base, emit);
+  }
+
+  // The input has ended: emits whatever is left.
+  template <typename F>
+  void finish(F&& emit) {
+    while (!stopped && token < end) replay(resolve(emit, {}, end), emit);
+    if (pending) emit(T_NULL, nullStart, nullEnd);
+    pending = false;
+  }
+
+  // Bytes pushed so far.
+  u64 offset() const { return end; }
+  // Recovery::Stop hit a byte that starts no token; later input is ignored.
+  bool stopped = false;
+
+private:
+  // The walk from `token` died at `end` (or the input ran out): emits the
+  // longest match, or one unmatched byte, and returns where lexing restarts.
+  template <typename F>
+  u64 resolve(F&& emit, const std::string_view& chunk, u64 base) {
+    auto restart = token + 1;
+    if (accepted) {
+      if (pending) emit(T_NULL, nullStart, nullEnd);
+      pending = false;
+      emit(keyword() ? view.keywords->retag(acceptTag, lexeme(chunk, base)) : acceptTag, token, acceptEnd);
+      restart = acceptEnd;
+    }
+    else if (recovery == Recovery::Stop) {
+      stopped = true;
+    }
+    else if (pending && nullEnd == token) {
+      ++nullEnd;
+    }
+    else {
+      if (pending) emit(T_NULL, nullStart, nullEnd);
+      pending = true;
+      nullStart = token;
+      nullEnd = token + 1;
+    }
+    curr = view.start;
+    token = restart;
+    accepted = false;
+    return restart;
+  }
+
+  // Lexes the kept bytes again from `from`, which is past the kept start.
+  template <typename F>
+  void replay(u64 from, F&& emit) {
+    if (stopped) return;
+    const auto bytes = kept.substr(from - keptStart);
+    kept.clear();
+    keptStart = from;
+    feed(bytes, from, emit);
+  }
+
+  // Walks `chunk`, which starts at offset `base`; kept holds the undecided
+  // bytes before it.
+  template <typename F>
+  void feed(const std::string_view& chunk, u64 base, F&& emit) {
+    const auto* p = chunk.data();
+    const i32 n = chunk.size();
+    for (i32 i = 0; i < n;) {
+      const auto next = view.advance(curr, p, i, n);
+      if (next != view.dead) {
+        curr = next;
+        ++i;
+        if (view.accepting[curr]) {
+          accepted = true;
+          acceptTag = view.states[curr];
+          acceptEnd = base + i;
+        }
+        continue;
+      }
+      const auto restart = resolve(emit, chunk, base);
+      if (stopped) return;
+      if (restart >= base) {
+        i = restart - base;
+        continue;
+      }
+      // The token began in an earlier chunk; everything up to here has to be
+      // walked again from the restart.
+      replay(restart, emit);
+      if (stopped) return;
+      i = 0;
+    }
+
+    // Keep what a later dead end could still back out to, or with keywords
+    // the whole token, whose rule isn't known until it ends.
+    const auto from = accepted && !view.keywords ? acceptEnd : token;
+    if (from >= base) {
+      kept.assign(chunk.substr(from - base));
+    }
+    else {
+      kept.erase(0, from - keptStart);
+      kept.append(chunk);
+    }
+    keptStart = from;
+  }
+
+  bool keyword() const { return view.keywords && acceptTag == view.keywords->from; }
+
+  // Bytes of the accepted token, from the kept bytes and those of `chunk`,
+  // which starts at `base`.
+  std::string_view lexeme(const std::string_view& chunk, u64 base) {
+    if (token >= base) return chunk.substr(token - base, acceptEnd - token);
+    const auto head = std::string_view(kept).substr(token - keptStart);
+    if (acceptEnd <= base) return head.substr(0, acceptEnd - token);
+    joined.assign(head);
+    joined.append(chunk.substr(0, acceptEnd - base));
+    return joined;
+  }
+
+  RegexView<T, T_NULL> view;
+  Recovery recovery;
+  i32 curr;
+  u64 end = 0;
+  // Start of the token being walked.
+  u64 token = 0;
+  bool accepted = false;
+  T acceptTag = T_NULL;
+  u64 acceptEnd = 0;
+  // Unmatched bytes not yet emitted, held back in case the next byte joins them.
+  bool pending = false;
+  u64 nullStart = 0;
+  u64 nullEnd = 0;
+  std::string kept;
+  u64 keptStart = 0;
+  // A keyword candidate split over chunks.
+  std::string joined;
 };
 
 template <typename T, T T_NULL, T (*TF)(T,T)>
 struct RegexLexer {
-  using transition_table_t = std::vector<std::unordered_map<char, mvector<i32>>>;
+  using transition_table_t = EdgeArena;
   using state_t = T;
+  static constexpr T null = T_NULL;
 
-  constexpr RegexLexer() : start(0), transitions({{}}), accept({}), states({ T_NULL }), alphabet({}) {}
-  RegexLexer(RegexLexer&& x) { *this = std::move(x); }
-  RegexLexer& operator=(RegexLexer&& x) {
+  constexpr RegexLexer() : start(0), transitions({ { -1 }, {} }), accept(), states({ T_NULL }), alphabet({}), byteClass({}), classes(1), dead(0) {}
+  constexpr RegexLexer(RegexLexer&& x) { *this = std::move(x); }
+  constexpr RegexLexer& operator=(RegexLexer&& x) {
     start = x.start;
     transitions = std::move(x.transitions);
     accept = std::move(x.accept);
     states = std::move(x.states);
     alphabet = std::move(x.alphabet);
+    table = std::move(x.table);
+    accepting = std::move(x.accepting);
+    accel = std::move(x.accel);
+    byteClass = x.byteClass;
+    classes = x.classes;
+    dead = x.dead;
+    priority = x.priority;
+    keywords = std::move(x.keywords);
+    REGEX_STAT(stats = x.stats;)
     return *this;
   }
-  RegexLexer(const RegexLexer& x) { *this = x; };
-  RegexLexer& operator=(const RegexLexer& x) {
+  constexpr RegexLexer(const RegexLexer& x) { *this = x; };
+  constexpr RegexLexer& operator=(const RegexLexer& x) {
     start = x.start;
     transitions = x.transitions;
     accept = x.accept;
     states = x.states;
     alphabet = x.alphabet;
+    table = x.table;
+    accepting = x.accepting;
+    accel = x.accel;
+    byteClass = x.byteClass;
+    classes = x.classes;
+    dead = x.dead;
+    priority = x.priority;
+    keywords = x.keywords;
+    REGEX_STAT(stats = x.stats;)
     return *this;
   }
 
   constexpr auto addState() {
     states.push_back(T_NULL);
-    transitions.push_back({});
-    /*if(transitions.size() != states.size())
-      exit(-1);*/
+    transitions.addState();
     return states.size() - 1;
   }
 
   constexpr RegexLexer& concat(char c, const std::optional<T> t = {}) {
     const i32 ne = addState();
     if (t.has_value()) states[ne] = *t;
-    std::for_each(accept.begin(), accept.end(), [&](auto n) { transitions[n][c].push_back(ne); });
-    if (!accept.size()) transitions[start][c].push_back(ne);
+    std::for_each(accept.begin(), accept.end(), [&](auto n) { transitions.add(n, c, ne); });
+    if (!accept.size()) transitions.add(start, c, ne);
     accept = { ne };
     if (std::find(alphabet.begin(), alphabet.end(), c) == alphabet.end()) alphabet.push_back(c);
     return *this;
   }
 
+  constexpr RegexLexer& concat(RegexLexer&& x) {
+    if (!accept.size()) return *this = std::move(x);
+    return concat(std::as_const(x));
+  }
+
   constexpr RegexLexer& concat(const RegexLexer& x) {
     if (!accept.size()) return *this = x;
     const auto maxx = states.size();
-    std::for_each(accept.begin(), accept.end(), [&](auto n) { transitions[n]['\0'].push_back(x.start + maxx); });
-    std::copy_if(x.alphabet.begin(), x.alphabet.end(), std::back_inserter(alphabet), [&](auto c) {
-      return std::find(alphabet.begin(), alphabet.end(), c) == alphabet.end();
-    });
-    transitions.reserve(states.size() + x.states.size());
-    for (auto s1 = 0; s1 < x.states.size(); ++s1) {
-      transitions.push_back({});
-      const auto& m = x.transitions[s1];
-      for (const auto& [c, v] : m) {
-        auto& tr = transitions[s1 + maxx][c];
-        for (const auto& s2 : v) tr.push_back(s2 + maxx);
-      }
-    }
+    std::for_each(accept.begin(), accept.end(), [&](auto n) { transitions.add(n, '\0', x.start + maxx); });
+    extendAlphabet(x.alphabet);
+    transitions.append(x.transitions);
     states.insert(states.end(), x.states.begin(), x.states.end());
     accept = x.accept;
     std::transform(accept.begin(), accept.end(), accept.begin(), [&](auto n) { return n + maxx; });
     return *this;
   }
 
-  char escapeChar(char c) const {
+  // One lexer for a list of { regex, tag } rules, where the earliest rule
+  // wins when several match the same input. Each rule's fragment is spliced
+  // straight behind a single shared start state, so unlike alter() in a loop
+  // there is no chain of epsilon states and the cost is linear in the rules.
+  static constexpr RegexLexer fromRules(std::span<const std::pair<std::string_view, T>> rules) {
+    RegexLexer out;
+    out.priority = Priority::Order;
+    for (const auto& [r, t] : rules) {
+      const auto x = parse(r, t);
+      if (x.accept.empty()) continue;
+      const i32 base = out.states.size();
+      out.transitions.add(out.start, '\0', x.start + base);
+      out.extendAlphabet(x.alphabet);
+      out.transitions.append(x.transitions);
+      out.states.insert(out.states.end(), x.states.begin(), x.states.end());
+      for (const auto a : x.accept) out.accept.push_back(a + base);
+    }
+    return out;
+  }
+
+  // As above, but the rule with the lowest `priority` wins, ties going to
+  // the earlier rule.
+  static constexpr RegexLexer fromRules(std::span<const std::pair<std::string_view, T>> rules, std::span<const i32> priority) {
+    std::vector<i32> order(rules.size());
+    std::iota(order.begin(), order.end(), 0);
+    std::stable_sort(order.begin(), order.end(), [&](i32 a, i32 b) { return priority[a] < priority[b]; });
+    std::vector<std::pair<std::string_view, T>> sorted;
+    for (const auto i : order) sorted.push_back(rules[i]);
+    return fromRules(sorted);
+  }
+
+  constexpr char escapeChar(char c) const {
     switch (c) {
       case 't': return '\t';
       case 'n': return '\n';
@@ -166,67 +1211,71 @@ struct RegexLexer {
   }
 
 
-  RegexLexer& concatClass(const std::string_view& str) {
-    const i32 ne = addState();
-    bool escape = false;
-    if (str[0] == '^') {
-      bool exclude[256] = {};
-      const auto str2 = str.substr(1);
-      for (auto c : str2) {
-        if (!escape && c == '\\') {
-          escape = true;
-          continue;
-        }
-        if (escape) {
-          escape = false;
-          c = escapeChar(c);
-        }
-        exclude[c] = true;
+  // Appends the bytes of `cs` that are not in the alphabet yet.
+  constexpr void extendAlphabet(const auto& cs) {
+    bool seen[256] = {};
+    for (const auto c : alphabet) seen[static_cast<u8>(c)] = true;
+    for (const auto c : cs) {
+      if (seen[static_cast<u8>(c)]) continue;
+      seen[static_cast<u8>(c)] = true;
+      alphabet.push_back(c);
+    }
+  }
+
+  // The inside of a [...] class: bytes, escapes and a-z ranges, negated by
+  // a leading ^. Takes one edge per run of consecutive bytes in the class
+  // rather than one per byte.
+  constexpr RegexLexer& concatClass(const std::string_view& str) {
+    std::array<bool, 256> in = {};
+    const auto negate = str.size() && str[0] == '^';
+    const auto next = [&](size_t& i) -> u8 {
+      return str[i] == '\\' && i + 1 < str.size() ? escapeChar(str[++i]) : str[i];
+    };
+    for (size_t i = negate; i < str.size(); ++i) {
+      const auto lo = next(i);
+      if (i + 2 < str.size() && str[i + 1] == '-') {
+        i += 2;
+        const auto hi = next(i);
+        if (hi < lo) throw std::invalid_argument("regex class range is reversed");
+        for (i32 c = lo; c <= hi; ++c) in[c] = true;
       }
-      for (auto c = 1; c < 256; ++c) {
-        if (exclude[c]) continue;
-        std::for_each(accept.begin(), accept.end(), [&](auto n) { transitions[n][c].push_back(ne); });
-        if (!accept.size()) transitions[start][c].push_back(ne);
-        if (std::find(alphabet.begin(), alphabet.end(), c) == alphabet.end()) alphabet.push_back(c);
+      else {
+        in[lo] = true;
       }
     }
-    else {
-      for (auto c : str) {
-        if (!escape && c == '\\') {
-          escape = true;
-          continue;
-        }
-        if (escape) {
-          escape = false;
-          c = escapeChar(c);
-        }
-        std::for_each(accept.begin(), accept.end(), [&](auto n) { transitions[n][c].push_back(ne); });
-        if (!accept.size()) transitions[start][c].push_back(ne);
-        if (std::find(alphabet.begin(), alphabet.end(), c) == alphabet.end()) alphabet.push_back(c);
+    if (negate) std::transform(in.begin(), in.end(), in.begin(), std::logical_not());
+    in[0] = false;
+
+    const i32 ne = addState();
+    std::vector<char> cs;
+    for (i32 lo = 1, hi; lo < 256; lo = hi + 1) {
+      if (!in[lo]) {
+        hi = lo;
+        continue;
       }
+      for (hi = lo; hi + 1 < 256 && in[hi + 1]; ++hi) cs.push_back(hi);
+      cs.push_back(hi);
+      std::for_each(accept.begin(), accept.end(), [&](auto n) { transitions.add(n, lo, hi, ne); });
+      if (!accept.size()) transitions.add(start, lo, hi, ne);
     }
+    extendAlphabet(cs);
     accept = { ne };
     return *this;
   }
 
+  constexpr RegexLexer& alter(RegexLexer&& x) {
+    if (!accept.size()) return *this = std::move(x);
+    return alter(std::as_const(x));
+  }
+
   constexpr RegexLexer& alter(const RegexLexer& x) { 
     if (!accept.size()) return *this = x;
     const auto ns = addState();
     const auto maxx = states.size();
-    transitions[ns]['\0'].push_back(start);
-    transitions[ns]['\0'].push_back(x.start + maxx);
-    std::copy_if(x.alphabet.begin(), x.alphabet.end(), std::back_inserter(alphabet), [&](auto c) {
-      return std::find(alphabet.begin(), alphabet.end(), c) == alphabet.end();
-    });
-    transitions.reserve(states.size() + x.states.size());
-    for (auto s1 = 0; s1 < x.states.size(); ++s1) {
-      transitions.push_back({});
-      const auto& m = x.transitions[s1];
-      for (const auto& [c, v] : m) {
-        auto& tr = transitions[s1 + maxx][c];
-        for (const auto& s2 : v) tr.push_back(s2 + maxx);
-      }
-    }
+    transitions.add(ns, '\0', start);
+    transitions.add(ns, '\0', x.start + maxx);
+    extendAlphabet(x.alphabet);
+    transitions.append(x.transitions);
     states.insert(states.end(), x.states.begin(), x.states.end());
     std::transform(x.accept.begin(), x.accept.end(), std::back_inserter(accept), [&](auto n) { return n + maxx; });
     start = ns;
@@ -236,9 +1285,9 @@ struct RegexLexer {
   constexpr RegexLexer& close() {
     if (!accept.size()) return *this;
     const i32 ne = addState();
-    std::for_each(accept.begin(), accept.end(), [&](auto n) { transitions[n]['\0'].push_back(ne); });
-    transitions[start]['\0'].push_back(ne);
-    std::for_each(accept.begin(), accept.end(), [&](auto n) { transitions[n]['\0'].push_back(start); });
+    std::for_each(accept.begin(), accept.end(), [&](auto n) { transitions.add(n, '\0', ne); });
+    transitions.add(start, '\0', ne);
+    std::for_each(accept.begin(), accept.end(), [&](auto n) { transitions.add(n, '\0', start); });
     accept = { ne };
     return *this;
   }
@@ -246,8 +1295,8 @@ struct RegexLexer {
   constexpr RegexLexer& optional() {
     if (!accept.size()) return *this;
     const i32 ne = addState();
-    transitions[start]['\0'].push_back(ne);
-    std::for_each(accept.begin(), accept.end(), [&](auto n) { transitions[n]['\0'].push_back(ne); });
+    transitions.add(start, '\0', ne);
+    std::for_each(accept.begin(), accept.end(), [&](auto n) { transitions.add(n, '\0', ne); });
     accept = { ne };
     return *this;
   }
@@ -255,107 +1304,520 @@ struct RegexLexer {
   constexpr RegexLexer& concatClose() {
     if (!accept.size()) return *this;
     const i32 ne = addState();
-    std::for_each(accept.begin(), accept.end(), [&](auto n) { transitions[n]['\0'].push_back(ne); });
-    std::for_each(accept.begin(), accept.end(), [&](auto n) { transitions[n]['\0'].push_back(start); });
+    std::for_each(accept.begin(), accept.end(), [&](auto n) { transitions.add(n, '\0', ne); });
+    std::for_each(accept.begin(), accept.end(), [&](auto n) { transitions.add(n, '\0', start); });
     accept = { ne };
     return *this;
   }
 
-  RegexLexer& dfa() {
-    std::vector<std::vector<i32>> epsilonCache;
-    epsilonCache.reserve(states.size());
-    const std::function<std::vector<i32>(std::vector<i32>)> epsilonClosure = [&](auto s) {
-      auto s2 = s;
-      for (const auto n : s2) {
-        if (epsilonCache.size() > n) {
-          const auto& t2 = epsilonCache[n];
-          std::copy_if(t2.begin(), t2.end(), std::back_inserter(s), [&](auto n) {
-            for (const auto x : s) { if (x == n) return false; }
-            return true;
-          });
+  // Splits the bytes into classes no NFA edge tells apart: two bytes share a
+  // class when every state sends them to the same targets. Byte 0 marks
+  // epsilon edges, so it only ever shares a class with bytes that have no
+  // edges at all. Each state's ranges are cut where any of them starts or
+  // ends, and the bytes of a piece all have the same targets.
+  constexpr void computeClasses() {
+    std::array<i32, 256> cls = {}, sig;
+    std::vector<i32> remap(256 * 257, -1), used;
+    std::vector<EdgeArena::Edge> out;
+    std::vector<i32> cuts, targets;
+    // The distinct target lists among a state's pieces.
+    std::vector<std::vector<i32>> lists;
+    classes = 1;
+    for (i32 q = 0; q < transitions.size(); ++q) {
+      out.clear();
+      cuts.clear();
+      transitions.each(q, [&](u8 lo, u8 hi, i32 t) {
+        if (!lo) return;
+        out.push_back({ lo, hi, t, 0 });
+        cuts.push_back(lo);
+        cuts.push_back(hi + 1);
+      });
+      if (out.empty()) continue;
+      std::sort(cuts.begin(), cuts.end());
+      cuts.erase(std::unique(cuts.begin(), cuts.end()), cuts.end());
+      sig.fill(-1);
+      lists.clear();
+      for (i32 p = 0; p + 1 < cuts.size(); ++p) {
+        targets.clear();
+        for (const auto& e : out) {
+          if (e.lo <= cuts[p] && cuts[p] <= e.hi) targets.push_back(e.to);
         }
-        else {
-          std::vector<i32> t2;
-          const auto& tr = transitions[n]['\0'];
-          t2.insert(t2.end(), tr.begin(), tr.end());
-          t2 = epsilonClosure(t2);
-          std::copy_if(t2.begin(), t2.end(), std::back_inserter(s), [&](auto n) {
-            for (const auto x : s) { if (x == n) return false; }
-            return true;
-          });
+        if (targets.empty()) continue;
+        std::sort(targets.begin(), targets.end());
+        targets.erase(std::unique(targets.begin(), targets.end()), targets.end());
+        i32 k = std::find(lists.begin(), lists.end(), targets) - lists.begin();
+        if (k == lists.size()) lists.push_back(targets);
+        std::fill(sig.begin() + cuts[p], sig.begin() + cuts[p + 1], k);
+      }
+      classes = 0;
+      for (auto b = 0; b < 256; ++b) {
+        const auto key = cls[b] * 257 + sig[b] + 1;
+        if (remap[key] == -1) {
+          remap[key] = classes++;
+          used.push_back(key);
         }
+        cls[b] = remap[key];
       }
-      return s;
-    };
-    for (i32 i = 0; i < states.size(); ++i) epsilonCache.push_back(std::move(epsilonClosure({ i })));
-    const auto epsilonCached = [&](std::unordered_set<i32>&& s) {
-      std::vector<i32> s2(s.begin(), s.end());
-      for (const auto& n : s2) {
-        const auto& c = epsilonCache[n];
-        s.insert(c.begin(), c.end());
-      }
-      return std::move(s);
-    };
+      for (const auto key : used) remap[key] = -1;
+      used.clear();
+    }
+    std::copy(cls.begin(), cls.end(), byteClass.begin());
+  }
+
+  // The NFA side of subset construction, shared by dfa() and LazyRegexLexer:
+  // epsilon closures as rows of `words` u64s, and each state's edges
+  // regrouped by byte class. Needs computeClasses() to have run.
+  //
+  // A closure is only ever asked for at the start state and at the target of
+  // a byte edge, so rows are built the first time one is asked for. dfa()
+  // reaches every target in the end, but a LazyRegexLexer only those its
+  // input leads to, and holds that many rows rather than one per NFA state.
+  // Building rows mutates the table, so it is only safe to share between
+  // threads once closeAll() has run.
+  struct Subsets {
+    constexpr Subsets(const RegexLexer& nfa)
+      : n(nfa.states.size()), words((n + 63) / 64), priority(nfa.priority), tags(nfa.states), rowOf(n, -1) {
+      epsOff.resize(n + 1);
+      for (i32 q = 0; q < n; ++q) {
+        nfa.transitions.each(q, [&](u8 lo, u8, i32 t) {
+          if (!lo) eps.push_back(t);
+        });
+        epsOff[q + 1] = eps.size();
+      }
+
+      // Class boundaries refine every range's, so a range is a union of
+      // whole classes: one edge per class it covers.
+      std::vector<i32> seen(nfa.classes, -1);
+      i32 stamp = 0;
+      edgeOff.resize(n + 1);
+      for (i32 q = 0; q < n; ++q) {
+        nfa.transitions.each(q, [&](u8 lo, u8 hi, i32 t) {
+          if (!lo) return;
+          ++stamp;
+          for (i32 c = lo; c <= hi; ++c) {
+            const auto k = nfa.byteClass[c];
+            if (seen[k] == stamp) continue;
+            seen[k] = stamp;
+            edges.push_back({ k, t });
+          }
+        });
+        std::sort(edges.begin() + edgeOff[q], edges.end());
+        edges.erase(std::unique(edges.begin() + edgeOff[q], edges.end()), edges.end());
+        edgeOff[q + 1] = edges.size();
+      }
+
+      acceptBits.resize(words);
+      for (const auto a : nfa.accept) acceptBits[a >> 6] |= u64(1) << (a & 63);
+    }
+
+    // Valid until the next call builds a row.
+    constexpr const u64* closureOf(i32 q) {
+      if (rowOf[q] == -1) close(q);
+      return &closure[rowOf[q] * words];
+    }
+
+    // Builds every row dfa() will need when starting from `start`.
+    constexpr void closeAll(i32 start) {
+      closureOf(start);
+      for (const auto& [k, t] : edges) closureOf(t);
+    }
+
+    constexpr void each(const u64* set, auto&& f) const {
+      for (i32 w = 0; w < words; ++w) {
+        for (auto x = set[w]; x; x &= x - 1) f((w << 6) | std::countr_zero(x));
+      }
+    }
+
+    constexpr T tag(const u64* set) const {
+      auto t = T_NULL;
+      each(set, [&](i32 q) {
+        if (priority == Priority::Fold) t = TF(t, tags[q]);
+        else if (t == T_NULL) t = tags[q];
+      });
+      return t;
+    }
+
+    constexpr bool accepts(const u64* set) const {
+      for (i32 w = 0; w < words; ++w) {
+        if (set[w] & acceptBits[w]) return true;
+      }
+      return false;
+    }
+
+    // Writes the successor of `set` on every class k to out[k * words],
+    // setting touched[k] for the non-empty ones.
+    constexpr void expand(const u64* set, u64* out, u8* touched) {
+      each(set, [&](i32 q) {
+        for (auto e = edgeOff[q]; e < edgeOff[q + 1]; ++e) {
+          const auto [k, t] = edges[e];
+          auto* row = &out[k * words];
+          const auto* cl = closureOf(t);
+          touched[k] = 1;
+          for (i32 w = 0; w < words; ++w) row[w] |= cl[w];
+        }
+      });
+    }
 
-    const auto delta = [&](const auto& s, auto c) {
-      std::unordered_set<i32> out;
-      for (const auto n : s) {
-        const auto& dc = transitions[n];
-        const auto& dcc = dc.find(c);
-        if (dcc != dc.end()) out.insert(dcc->second.begin(), dcc->second.end());
+    // Writes the successor of `set` on class `k` to `out`. Returns false if
+    // it is empty.
+    constexpr bool next(const u64* set, i32 k, u64* out) {
+      std::fill(out, out + words, 0);
+      bool any = false;
+      each(set, [&](i32 q) {
+        for (auto e = edgeOff[q]; e < edgeOff[q + 1]; ++e) {
+          if (edges[e].first != k) continue;
+          const auto* cl = closureOf(edges[e].second);
+          any = true;
+          for (i32 w = 0; w < words; ++w) out[w] |= cl[w];
+        }
+      });
+      return any;
+    }
+
+    // Walks the epsilon edges from `q`. Where a walk meets a state whose
+    // closure is already built, that row is merged instead of walked again.
+    constexpr void close(i32 q) {
+      const i32 at = closure.size();
+      closure.resize(at + words);
+      auto* row = &closure[at];
+      row[q >> 6] |= u64(1) << (q & 63);
+      std::vector<i32> stack = { q };
+      while (stack.size()) {
+        const auto p = stack.back();
+        stack.pop_back();
+        for (auto e = epsOff[p]; e < epsOff[p + 1]; ++e) {
+          const auto t = eps[e];
+          if ((row[t >> 6] >> (t & 63)) & 1) continue;
+          if (rowOf[t] != -1) {
+            const auto* done = &closure[rowOf[t] * words];
+            for (i32 w = 0; w < words; ++w) row[w] |= done[w];
+          }
+          else {
+            row[t >> 6] |= u64(1) << (t & 63);
+            stack.push_back(t);
+          }
+        }
       }
-      return out;
+      rowOf[q] = at / words;
+    }
+
+    i32 n;
+    i32 words;
+    Priority priority;
+    std::vector<T> tags;
+    std::vector<i32> epsOff;
+    std::vector<i32> eps;
+    std::vector<i32> rowOf;
+    std::vector<u64> closure;
+    std::vector<u64> acceptBits;
+    std::vector<i32> edgeOff;
+    std::vector<std::pair<i32, i32>> edges;
+  };
+
+  // Subset construction over dense bitsets and byte classes. DFA states are
+  // numbered in BFS order as they are first reached. Consumes the NFA:
+  // `transitions` is left empty and `table` holds the DFA.
+  //
+  // With `threads` > 1, states are taken a batch at a time: every state in
+  // the batch is expanded on all classes in parallel, then the successors are
+  // looked up and numbered on one thread, state by state and class by class.
+  // That is the order the single threaded loop inserts them in, so the DFA
+  // is identical whatever the thread count. `threads` is capped at the
+  // hardware's.
+  constexpr RegexLexer& dfa(i32 threads = 1) {
+    REGEX_STAT(const auto t0 = statsClock(); stats.nfaStates = states.size(); stats.nfaEdges = transitions.edges.size();)
+    computeClasses();
+    Subsets nfa(*this);
+    const auto words = nfa.words;
+    BitsetTable sets(words);
+    threads = std::is_constant_evaluated() ? 1 : std::clamp<i32>(threads, 1, std::max(std::thread::hardware_concurrency(), 1u));
+    if (threads > 1) nfa.closeAll(start);
+
+    std::vector<i32> _table;
+    std::vector<state_t> nstates;
+    decltype(accept) _accept;
+    const i32 batch = threads == 1 ? 1 : 64;
+    const auto rowWords = classes * words;
+    std::vector<u64> out(batch * rowWords);
+    std::vector<u8> touched(batch * classes);
+    i32 curr = 0, n = 0;
+    const auto expand = [&](i32 b) {
+      std::fill(&touched[b * classes], &touched[b * classes] + classes, 0);
+      std::fill(&out[b * rowWords], &out[b * rowWords] + rowWords, 0);
+      nfa.expand(sets[curr + b], &out[b * rowWords], &touched[b * classes]);
     };
 
-    std::vector<std::unordered_set<i32>> ns, work = { epsilonCached({ start }) };
-    std::vector<state_t> nstates = { T_NULL };
+    // Workers wait at the barrier for a batch, expand every threads'th state
+    // of it, and meet again once the batch is done. However dfa() is left,
+    // even by an exception, the destructor finishes the phase under way and
+    // lets them out, standing in for any that failed to start.
+    struct Workers {
+      constexpr ~Workers() {
+        if (!sync) return;
+        if (inBatch) sync->arrive_and_wait();
+        stop = true;
+        for (auto t = pool.size() + 1; t < threads; ++t) sync->arrive_and_drop();
+        sync->arrive_and_wait();
+        for (auto& t : pool) t.join();
+        delete sync;
+      }
+      constexpr void phase() {
+        if (!sync) return;
+        sync->arrive_and_wait();
+        inBatch = !inBatch;
+      }
+      size_t threads;
+      std::vector<std::thread> pool;
+      std::barrier<>* sync = nullptr;
+      bool stop = false;
+      bool inBatch = false;
+    } workers { static_cast<size_t>(threads) };
+    if (threads > 1) {
+      workers.sync = new std::barrier<>(threads);
+      for (i32 t = 1; t < threads; ++t) {
+        workers.pool.emplace_back([&, t] {
+          auto& sync = *workers.sync;
+          for (sync.arrive_and_wait(); !workers.stop; sync.arrive_and_wait()) {
+            for (auto b = t; b < n; b += threads) expand(b);
+            sync.arrive_and_wait();
+          }
+        });
+      }
+    }
+
+    sets.insert(nfa.closureOf(start));
+    for (; curr < sets.size(); curr += n) {
+      REGEX_STAT(stats.subsetPeak = std::max(stats.subsetPeak, sets.size() - curr);)
+      n = std::min(batch, sets.size() - curr);
+      workers.phase();
+      for (auto b = 0; b < n; b += threads) expand(b);
+      workers.phase();
+      for (auto b = 0; b < n; ++b) {
+        nstates.push_back(nfa.tag(sets[curr + b]));
+        if (nfa.accepts(sets[curr + b])) _accept.push_back(curr + b);
+        for (i32 k = 0; k < classes; ++k) {
+          _table.push_back(touched[b * classes + k] ? sets.insert(&out[b * rowWords + k * words]).first : -1);
+        }
+      }
+    }
+
     start = 0;
-    transition_table_t _transitions;
-
-    std::unordered_map<std::unordered_set<i32>, i32> nsc;
-    const auto getns = [&](const std::unordered_set<i32>& set) -> size_t {
-      const auto& found = nsc.find(set);
-      if (found != nsc.end()) return found->second;
-      ns.push_back(set);
-      const auto n = ns.size() - 1;
-      nsc[set] = n;
-      _transitions.push_back({});
-      return n;
+    accept = std::move(_accept);
+    transitions.clear();
+    states = std::move(nstates);
+    table = std::move(_table);
+    compile();
+    REGEX_STAT(stats.dfaStates = states.size(); stats.dfaMs = statsClock() - t0;)
+    return *this;
+  }
+
+  // Hopcroft partition refinement over the compiled table. Blocks start out
+  // keyed on (tag, accepting); the dead row takes part like any other state
+  // so a missing transition distinguishes states the same way minimiseNaive
+  // does. Runs in O(n * classes * log n).
+  constexpr RegexLexer& minimise() {
+    REGEX_STAT(const auto t0 = statsClock(); stats.minimiseRounds = 0;)
+    const i32 K = classes;
+    const i32 n = states.size() + 1;
+    const auto tag = [&](i32 s) { return s == dead ? T_NULL : states[s]; };
+    std::vector<u8> accepting(n);
+    for (const auto a : accept) accepting[a] = 1;
+
+    // Inverse transitions, bucketed by (target, class).
+    std::vector<i32> inOff(n * K + 1), in(n * K);
+    for (i32 s = 0; s < n; ++s) {
+      for (i32 c = 0; c < K; ++c) ++inOff[table[s * K + c] * K + c + 1];
+    }
+    std::partial_sum(inOff.begin(), inOff.end(), inOff.begin());
+    {
+      auto fill = inOff;
+      for (i32 s = 0; s < n; ++s) {
+        for (i32 c = 0; c < K; ++c) in[fill[table[s * K + c] * K + c]++] = s;
+      }
+    }
+
+    // Blocks are contiguous ranges of `elems`; marked states are swapped to
+    // the front of their block.
+    std::vector<i32> elems(n), loc(n), blockOf(n), first, last, marked;
+    {
+      std::vector<std::pair<T, u8>> keys;
+      for (i32 s = 0; s < n; ++s) {
+        const std::pair<T, u8> key = { tag(s), accepting[s] };
+        const auto found = std::find(keys.begin(), keys.end(), key);
+        blockOf[s] = found - keys.begin();
+        if (found == keys.end()) keys.push_back(key);
+      }
+      first.assign(keys.size() + 1, 0);
+      for (i32 s = 0; s < n; ++s) ++first[blockOf[s] + 1];
+      std::partial_sum(first.begin(), first.end(), first.begin());
+      last.assign(first.begin() + 1, first.end());
+      first.pop_back();
+      auto fill = first;
+      for (i32 s = 0; s < n; ++s) {
+        loc[s] = fill[blockOf[s]]++;
+        elems[loc[s]] = s;
+      }
+      marked.assign(keys.size(), 0);
+    }
+
+    std::vector<std::pair<i32, i32>> work;
+    std::vector<u8> inWork(first.size() * K);
+    const auto push = [&](i32 b, i32 c) {
+      inWork[b * K + c] = 1;
+      work.push_back({ b, c });
     };
+    {
+      i32 largest = 0;
+      for (i32 b = 1; b < first.size(); ++b) {
+        if (last[b] - first[b] > last[largest] - first[largest]) largest = b;
+      }
+      for (i32 b = 0; b < first.size(); ++b) {
+        if (b == largest) continue;
+        for (i32 c = 0; c < K; ++c) push(b, c);
+      }
+    }
 
+    std::vector<i32> splitter, touched;
     while (work.size()) {
-      auto curr = work.back();
+      const auto [b, c] = work.back();
       work.pop_back();
-      const auto nn = getns(curr);
-      for (const auto c : alphabet) {
-        std::unordered_set<i32> s = epsilonCached(delta(curr, c));
-        if (!s.size()) continue;
-        const auto beforeSize = ns.size();
-        const auto to = getns(s);
-        _transitions[nn][c] = { static_cast<i32>(to) };
-        if (beforeSize != ns.size()) {
-          nstates.push_back(std::reduce(s.begin(), s.end(), T_NULL, [&](auto acc, auto n) {
-            return TF(acc, states[n]);
-          }));
-          work.push_back(std::move(s));
+      inWork[b * K + c] = 0;
+      REGEX_STAT(++stats.minimiseRounds;)
+
+      splitter.clear();
+      for (i32 j = first[b]; j < last[b]; ++j) {
+        const auto q = elems[j] * K + c;
+        splitter.insert(splitter.end(), in.begin() + inOff[q], in.begin() + inOff[q + 1]);
+      }
+      for (const auto p : splitter) {
+        const auto y = blockOf[p];
+        if (!marked[y]) touched.push_back(y);
+        const auto to = first[y] + marked[y]++;
+        const auto other = elems[to];
+        std::swap(elems[loc[p]], elems[to]);
+        loc[other] = loc[p];
+        loc[p] = to;
+      }
+
+      for (const auto y : touched) {
+        const auto m = marked[y];
+        marked[y] = 0;
+        if (m == last[y] - first[y]) continue;
+        const i32 z = first.size();
+        first.push_back(first[y]);
+        last.push_back(first[y] + m);
+        marked.push_back(0);
+        inWork.resize(inWork.size() + K);
+        first[y] += m;
+        for (i32 j = first[z]; j < last[z]; ++j) blockOf[elems[j]] = z;
+        const auto smaller = last[z] - first[z] <= last[y] - first[y] ? z : y;
+        for (i32 c2 = 0; c2 < K; ++c2) push(inWork[y * K + c2] ? z : smaller, c2);
+      }
+      touched.clear();
+    }
+
+    // Renumber blocks in order of their first state, dropping the dead block.
+    const auto deadBlock = blockOf[dead];
+    std::vector<i32> id(first.size(), -1), rep;
+    for (i32 s = 0; s < dead; ++s) {
+      const auto b = blockOf[s];
+      if (id[b] != -1 || (b == deadBlock && b != blockOf[start])) continue;
+      id[b] = rep.size();
+      rep.push_back(s);
+    }
+
+    std::vector<i32> _table;
+    std::vector<state_t> nstates(rep.size());
+    decltype(accept) _accept;
+    for (i32 i = 0; i < rep.size(); ++i) {
+      for (i32 c = 0; c < K; ++c) _table.push_back(id[blockOf[table[rep[i] * K + c]]]);
+      nstates[i] = states[rep[i]];
+      if (accepting[rep[i]]) _accept.push_back(i);
+    }
+
+    start = id[blockOf[start]];
+    states = std::move(nstates);
+    table = std::move(_table);
+    accept = std::move(_accept);
+    compile();
+    REGEX_STAT(stats.minimisedStates = states.size(); stats.minimiseMs = statsClock() - t0;)
+    return *this;
+  }
+
+  // Renumbers states and classes so that the ones used together sit together
+  // in `table`. Without a sample, states go in BFS order from `start`. With
+  // one, states and classes go by how often lexing `sample` uses them, busiest
+  // first, so the rows of the common paths share cache lines and pages, and
+  // their common columns lead each row. The DFA is unchanged but for the
+  // numbers; `dead` stays the last row.
+  constexpr RegexLexer& renumber(const std::string_view& sample = {}) {
+    const i32 K = classes;
+    std::vector<i32> order, classOrder(K);
+    std::iota(classOrder.begin(), classOrder.end(), 0);
+    if (sample.empty()) {
+      std::vector<u8> seen(dead + 1);
+      seen[dead] = 1;
+      const auto visit = [&](i32 s) {
+        if (seen[s]) return;
+        seen[s] = 1;
+        order.push_back(s);
+      };
+      visit(start);
+      for (i32 i = 0; i < order.size(); ++i) {
+        for (i32 c = 0; c < K; ++c) visit(table[order[i] * K + c]);
+      }
+      for (i32 s = 0; s < dead; ++s) visit(s);
+    }
+    else {
+      // Maximal munch over the sample, counting every row and column read.
+      std::vector<u64> hits(dead + 1), classHits(K);
+      const i32 n = sample.size();
+      for (i32 i = 0; i < n;) {
+        auto curr = start;
+        auto end = i;
+        ++hits[curr];
+        for (auto j = i; j < n; ++j) {
+          const auto k = byteClass[static_cast<u8>(sample[j])];
+          ++classHits[k];
+          curr = table[curr * K + k];
+          if (curr == dead) break;
+          ++hits[curr];
+          if (accepting[curr]) end = j + 1;
         }
+        i = end == i ? i + 1 : end;
       }
+      order.resize(dead);
+      std::iota(order.begin(), order.end(), 0);
+      std::stable_sort(order.begin(), order.end(), [&](i32 a, i32 b) { return hits[a] > hits[b]; });
+      std::stable_sort(classOrder.begin(), classOrder.end(), [&](i32 a, i32 b) { return classHits[a] > classHits[b]; });
     }
 
-    std::vector<i32> _accept = accept;
-    accept.clear();
-    for (auto i = 0; i < ns.size(); ++i) {
-      if (std::find_if(_accept.begin(), _accept.end(), [&](auto n) { return ns[i].contains(n); }) != _accept.end())
-        accept.push_back(i);
+    std::vector<i32> id(dead + 1), column(K);
+    for (i32 i = 0; i < dead; ++i) id[order[i]] = i;
+    id[dead] = dead;
+    for (i32 c = 0; c < K; ++c) column[classOrder[c]] = c;
+    std::vector<i32> _table(table.size());
+    std::vector<state_t> nstates(dead);
+    for (i32 s = 0; s <= dead; ++s) {
+      for (i32 c = 0; c < K; ++c) _table[id[s] * K + column[c]] = id[table[s * K + c]];
+      if (s < dead) nstates[id[s]] = states[s];
     }
-    transitions = std::move(_transitions);
+    for (auto& a : accept) a = id[a];
+    for (auto& k : byteClass) k = column[k];
+    start = id[start];
     states = std::move(nstates);
+    table = std::move(_table);
+    compile();
     return *this;
   }
 
-  RegexLexer& minimise() {
+  // The original group-splitting minimiser, kept as a reference for the
+  // construction benchmark. Quadratic in the number of states.
+  RegexLexer& minimiseNaive() {
+    REGEX_STAT(const auto t0 = statsClock(); stats.minimiseRounds = 0;)
+    const i32 K = classes;
     std::vector<std::unordered_set<i32>> p;
-    std::vector<i32> group(states.size()); 
+    std::vector<i32> group(states.size() + 1, -1);
     p.push_back({accept.begin(), accept.end()});
     p.push_back({});
     for (auto i = 0; i < states.size(); ++i) {
@@ -366,24 +1828,23 @@ struct RegexLexer {
     }
 
     const auto indistinguishable = [&](auto s1, auto s2, auto c) {
-      return group[transitions[s1].find(c)->second.val] == group[transitions[s2].find(c)->second.val];
+      return group[table[s1 * K + c]] == group[table[s2 * K + c]];
     };
 
     auto k = 0;
     do {
+      REGEX_STAT(++stats.minimiseRounds;)
       k = p.size();
       for (auto si = 0; si < p.size(); ++si) {
         auto& s = p[si];
         i32 s0 = (*s.begin());
         std::unordered_set<i32> indist = { s0 };
-        const auto& ti = transitions[s0];
         for (const auto j : s) {
           if (j == s0) continue;
           bool ind = true;
-          const auto& tj = transitions[j];
-          if (states[s0] != states[j] || ti.size() != tj.size()) continue;
-          for (const auto& [c, v] : ti) {
-            if (!tj.contains(c) || !indistinguishable(s0, j, c)) { ind = false; break; }
+          if (states[s0] != states[j]) continue;
+          for (i32 c = 0; c < K; ++c) {
+            if (!indistinguishable(s0, j, c)) { ind = false; break; }
           }
           if (ind) indist.insert(j);
         }
@@ -396,14 +1857,12 @@ struct RegexLexer {
     } while (k != p.size());
 
     std::vector<state_t> nstates(k);
-    transition_table_t _transitions(k);
-    std::vector<i32> _accept;
+    std::vector<i32> _table;
+    decltype(accept) _accept;
     auto _start = 0;
     for (auto i = 0; i < k; ++i) {
       const auto s0 = *p[i].begin();
-      for (const auto& [c, v] : transitions[s0]) {
-        _transitions[i][c] = { static_cast<i32>(group[v.val]) };
-      }
+      for (i32 c = 0; c < K; ++c) _table.push_back(group[table[s0 * K + c]]);
       nstates[i] = states[s0];
       auto accepted = false;
       for (const auto x : p[i]) {
@@ -416,21 +1875,58 @@ struct RegexLexer {
     }
 
     states = std::move(nstates);
-    transitions = std::move(_transitions);
+    table = std::move(_table);
     accept = std::move(_accept);
     start = _start;
 
+    compile();
+    REGEX_STAT(stats.minimisedStates = states.size(); stats.minimiseMs = statsClock() - t0;)
     return *this;
   }
 
-  static RegexLexer parse(const std::string_view& str, T t) {
+  // Seals a row-major state x class table whose missing transitions are -1:
+  // appends the dead sentinel row and points every missing transition at it.
+  constexpr RegexLexer& compile() {
+    dead = states.size();
+    table.resize((states.size() + 1) * classes, -1);
+    std::replace(table.begin(), table.end(), -1, dead);
+    accepting.assign(states.size() + 1, 0);
+    for (const auto a : accept) accepting[a] = 1;
+
+    // A state is accelerated when it loops on itself for all but at most four
+    // bytes, or for at most four. Unused byte slots repeat the first byte.
+    // Matching only scans once a step has looped on the state.
+    accel.assign(states.size() + 1, { Accel::None });
+    for (auto s = 0; s < states.size(); ++s) {
+      u8 stay[256] = {}, leave[256] = {};
+      auto stays = 0, leaves = 0;
+      for (auto b = 0; b < 256; ++b) {
+        if (table[s * classes + byteClass[b]] == s) stay[stays++] = b;
+        else leave[leaves++] = b;
+      }
+      if (!stays || !leaves) continue;
+      auto& a = accel[s];
+      const auto* bytes = leaves <= 4 ? leave : stays <= 4 ? stay : nullptr;
+      if (!bytes) continue;
+      a.mode = leaves <= 4 ? Accel::Until : Accel::While;
+      a.count = leaves <= 4 ? leaves : stays;
+      for (auto k = 0; k < 4; ++k) a.bytes[k] = bytes[k < a.count ? k : 0];
+    }
+    REGEX_STAT(
+      stats.transitions = dead * classes - std::count(table.begin(), table.begin() + dead * classes, dead);
+      stats.tableBytes = table.size() * sizeof(i32) + states.size() * sizeof(T) + accepting.size() + accel.size() * sizeof(Accel);
+    )
+    return *this;
+  }
+
+  constexpr static RegexLexer parse(const std::string_view& str, T t) {
     auto i = 0;
     auto out = parse(str, i);
     std::for_each(out.accept.begin(), out.accept.end(), [&](auto n) { out.states[n] = t; });
     return out;
   }
 
-  static RegexLexer parse(const std::string_view& str, auto& i) {
+  constexpr static RegexLexer parse(const std::string_view& str, auto& i) {
     const auto iscontrol = [&](auto c) {
       return c == '(' || c == ')' || c == '*' || c == '|' || c == '\\' || c == '+' || c == '?' || c == '[' || c == ']';
     };
@@ -440,19 +1936,23 @@ struct RegexLexer {
       if (i >= str.length()) return out;
       do {
         if (!iscontrol(str[i])) {
-          out.concat(token);
+          out.concat(std::move(token));
           token = std::move(RegexLexer().concat(str[i]));
           continue;
         }
         if (str[i] == '\\') {
-          out.concat(token);
+          if (i + 1 >= str.length()) throw std::invalid_argument("regex ends in \\");
+          out.concat(std::move(token));
           token = std::move(RegexLexer().concat(str[++i]));
           continue;
         }
         if (str[i] == '[') {
-          out.concat(token);
+          out.concat(std::move(token));
           const auto start = i + 1;
-          while (str[++i] != ']' && str[i - 1] != '\\');
+          while (++i < str.length() && str[i] != ']') {
+            if (str[i] == '\\') ++i;
+          }
+          if (i >= str.length()) throw std::invalid_argument("regex class has no closing ]");
           token = std::move(RegexLexer().concatClass(str.substr(start, i - start)));
           continue;
         }
@@ -470,46 +1970,440 @@ struct RegexLexer {
         }
         else if (str[i] == '(') {
           ++i;
-          out.concat(token);
+          out.concat(std::move(token));
           token = std::move(parse(str, i));
           continue;
         }
         break;
       } while (++i < str.length());
-      return std::move(out.concat(token));
-    };
-    const std::function<RegexLexer()> parse_ = [&]() {
-      auto lhs = parse_3();
-      if (i >= str.length()) return lhs;
-      switch (str[i]) {
-        case ')': return lhs;
-        case '|': ++i; return lhs.alter(parse_());
-      }
-      return lhs;
+      return std::move(out.concat(std::move(token)));
     };
-    return parse_();
+    auto lhs = parse_3();
+    if (i < str.length() && str[i] == '|') {
+      ++i;
+      lhs.alter(parse(str, i));
+    }
+    return lhs;
   }
 
-  T match(const std::string_view& str) const {
-    return match(str, 0).first;
+  // Retags tokens of the `from` rule that are one of `words`, see
+  // KeywordTable. The words then need no rules of their own. Images can't
+  // hold the table, so save() refuses a lexer with one.
+  RegexLexer& withKeywords(std::span<const std::pair<std::string_view, T>> words, T from) {
+    keywords = KeywordTable<T, T_NULL>(words, from);
+    REGEX_STAT(stats.keywordBytes = keywords.bytes();)
+    return *this;
   }
 
-  std::pair<T, Location> match(const std::string_view& str, i32 i) const {
-    auto curr = start;
-    Location loc = { .start = i, .end = i };
-    if (i >= str.length()) return { T_NULL, loc };
-    for (const auto c : str.substr(i)) {
-      const auto& next = transitions[curr].find(c);
-      if (next == transitions[curr].end()) break;
-      curr = next->second.val;
-      ++loc.end;
+  constexpr RegexView<T, T_NULL> view() const {
+    return { table.data(), states.data(), accepting.data(), accel.data(), byteClass.data(), classes, dead, start REGEX_STAT(, &matchStats),
+             keywords.empty() ? nullptr : &keywords };
+  }
+
+  // Fingerprint of a { regex, tag } rule list, for rejecting stale images.
+  static constexpr u64 fingerprint(const auto& rules) {
+    auto h = fnv1a({}) ^ sizeof(T);
+    for (const auto& [r, t] : rules) {
+      h = fnv1a(r, h);
+      h = (h ^ static_cast<u64>(t)) * 0x100000001b3ull;
     }
-    return { states[curr], loc };
+    return h;
+  }
+
+  // Writes the compiled DFA as an image that RegexImage::load can map.
+  // Returns false if the file could not be written, or if the lexer has a
+  // keyword table, which an image would silently drop.
+  bool save(const char* path, u64 fingerprint) const {
+    static_assert(std::is_trivially_copyable_v<T>);
+    if (!keywords.empty()) return false;
+    using H = RegexImageHeader;
+    std::vector<char> file(H::BODY);
+    const auto section = [&](const auto* data, size_t count) -> u64 {
+      const auto at = (file.size() + 63) & ~u64(63);
+      const auto bytes = count * sizeof(*data);
+      file.resize(at + bytes);
+      if (bytes) std::memcpy(&file[at], data, bytes);
+      return at;
+    };
+    H h = {};
+    std::copy(std::begin(H::MAGIC), std::end(H::MAGIC), h.magic);
+    h.version = H::VERSION;
+    h.tagSize = sizeof(T);
+    h.fingerprint = fingerprint;
+    h.classes = classes;
+    h.dead = dead;
+    h.start = start;
+    h.alphabetSize = alphabet.size();
+    h.table = section(table.data(), table.size());
+    h.states = section(states.data(), states.size());
+    h.accepting = section(accepting.data(), accepting.size());
+    h.accel = section(accel.data(), accel.size());
+    h.byteClass = section(byteClass.data(), byteClass.size());
+    h.alphabet = section(alphabet.data(), alphabet.size());
+    h.size = file.size();
+    h.checksum = fnv1a({ &file[H::BODY], file.size() - H::BODY });
+    std::memcpy(file.data(), &h, sizeof(h));
+
+    auto* f = std::fopen(path, "wb");
+    if (!f) return false;
+    const auto ok = std::fwrite(file.data(), 1, file.size(), f) == file.size();
+    return (std::fclose(f) == 0) && ok;
+  }
+
+  constexpr T match(const std::string_view& str) const { return view().match(str); }
+  constexpr std::pair<T, Location> match(const std::string_view& str, i32 i) const { return view().match(str, i); }
+  constexpr std::pair<T, i32> munch(const std::string_view& str, i32 i) const { return view().munch(str, i); }
+  void matchMany(std::span<const std::string_view> strs, std::span<T> out) const { view().matchMany(strs, out); }
+  Tokens<T> tokenize(const std::string_view& str, Recovery recovery = Recovery::Stop) const {
+    return view().tokenize(str, recovery);
+  }
+  i32 tokenize(const std::string_view& str, Tokens<T>& out, Recovery recovery = Recovery::Stop) const {
+    return view().tokenize(str, out, recovery);
+  }
+  Tokens<T> tokenizeParallel(const std::string_view& str, Recovery recovery = Recovery::Stop,
+                             i32 threads = std::thread::hardware_concurrency()) const {
+    return view().tokenizeParallel(str, recovery, threads);
   }
 
   std::vector<state_t> states;
   transition_table_t transitions;
   std::vector<char> alphabet;
   i32 start;
-  std::vector<i32> accept;
+  mvector<i32, 4> accept;
+  // DFA form: row-major state x class table with `dead` as the last row.
+  std::vector<i32> table;
+  std::vector<u8> accepting;
+  std::vector<Accel> accel;
+  std::array<u8, 256> byteClass;
+  i32 classes;
+  i32 dead;
+  Priority priority = Priority::Fold;
+  KeywordTable<T, T_NULL> keywords;
+  REGEX_STAT(RegexBuildStats stats; mutable RegexMatchStats matchStats;)
+};
+
+// Matches straight off an NFA, building DFA states only when the input
+// reaches them. States live in a cache of at most `capacity` entries whose
+// transitions start out unknown; when it fills up the whole cache is dropped
+// and rebuilt from whatever the input needs next. If it fills again after
+// less than 10 bytes per state, caching is not paying for itself and the
+// rest of that walk steps the NFA state set directly. Matching mutates the
+// cache, so use one instance per thread.
+template <typename RL>
+struct LazyRegexLexer {
+  using T = typename RL::state_t;
+  static constexpr T T_NULL = RL::null;
+  static constexpr i32 UNKNOWN = -2;
+  static constexpr i32 DEAD = -1;
+  static constexpr i32 SIMULATING = -3;
+
+  struct Stats {
+    u64 hits = 0;
+    u64 misses = 0;
+    u64 flushes = 0;
+    u64 nfaBytes = 0;
+  };
+
+  // `nfa` must not have been through dfa().
+  LazyRegexLexer(RL x, i32 capacity = 1 << 12)
+    : nfa(classified(x)), byteClass(x.byteClass), classes(x.classes), capacity(std::max(capacity, 2)), cache(nfa.words),
+      startSet(nfa.closureOf(x.start), nfa.closureOf(x.start) + nfa.words), sim(nfa.words), scratch(nfa.words) {}
+
+  T match(const std::string_view& str) { return match(str, 0).first; }
+
+  std::pair<T, Location> match(const std::string_view& str, i32 i) {
+    Location loc = { .start = i, .end = i };
+    if (i >= str.length()) return { T_NULL, loc };
+    auto curr = enter();
+    const i32 n = str.length();
+    auto j = i;
+    for (; j < n; ++j) {
+      const auto next = advance(curr, byteClass[static_cast<u8>(str[j])]);
+      if (next == DEAD) break;
+      curr = next;
+    }
+    loc.end = j;
+    return { tag(curr), loc };
+  }
+
+  // Longest match from `i`, as RegexView::munch.
+  std::pair<T, i32> munch(const std::string_view& str, i32 i) {
+    i32 reach;
+    return maximalMunch<T, T_NULL>(i, str.length(), enter(), DEAD,
+      [&](i32 s, i32 j) { return advance(s, byteClass[static_cast<u8>(str[j])]); },
+      [&](i32 s) { return accepts(s); },
+      [&](i32 s) { return tag(s); }, reach);
+  }
+
+  Tokens<T> tokenize(const std::string_view& str, Recovery recovery = Recovery::Stop) {
+    Tokens<T> out;
+    munchUntil<T, T_NULL>(0, str.length(), out, recovery, [&](i32 i) { return munch(str, i); });
+    return out;
+  }
+
+  // Cached states right now.
+  i32 size() const { return cache.size(); }
+
+  Stats stats;
+
+private:
+  static RL& classified(RL& x) {
+    x.computeClasses();
+    return x;
+  }
+
+  // A thrashing cache can leave the start set simulated rather than cached;
+  // that is never kept, so the next walk tries the cache again.
+  i32 enter() {
+    if (start != DEAD) return start;
+    const auto s = add(startSet.data());
+    if (s != SIMULATING) start = s;
+    return s;
+  }
+
+  i32 add(const u64* set) {
+    if (cache.size() >= capacity) {
+      const auto thrashing = stats.flushes && bytes - flushedAt < u64(10) * capacity;
+      ++stats.flushes;
+      flushedAt = bytes;
+      cache.clear();
+      next.clear();
+      tags.clear();
+      accepting.clear();
+      start = DEAD;
+      if (thrashing) {
+        std::copy(set, set + nfa.words, sim.begin());
+        return SIMULATING;
+      }
+    }
+    cache.insert(set);
+    next.resize(next.size() + classes, UNKNOWN);
+    tags.push_back(nfa.tag(set));
+    accepting.push_back(nfa.accepts(set));
+    return cache.size() - 1;
+  }
+
+  // The state after `s` on class `k`, or DEAD. Once a walk is SIMULATING it
+  // stays that way; the next walk starts from the cache again.
+  i32 advance(i32 s, i32 k) {
+    ++bytes;
+    if (s == SIMULATING) {
+      ++stats.nfaBytes;
+      if (!nfa.next(sim.data(), k, scratch.data())) return DEAD;
+      std::swap(sim, scratch);
+      return SIMULATING;
+    }
+    if (const auto to = next[s * classes + k]; to != UNKNOWN) {
+      ++stats.hits;
+      return to;
+    }
+    ++stats.misses;
+    if (!nfa.next(cache[s], k, scratch.data())) return next[s * classes + k] = DEAD;
+    if (const auto found = cache.find(scratch.data()); found != -1) return next[s * classes + k] = found;
+    // A flush forgets `s`, so the edge is only recorded if it survived.
+    const auto full = cache.size() >= capacity;
+    const auto to = add(scratch.data());
+    if (!full) next[s * classes + k] = to;
+    return to;
+  }
+
+  T tag(i32 s) const { return s == SIMULATING ? nfa.tag(sim.data()) : tags[s]; }
+  bool accepts(i32 s) const { return s == SIMULATING ? nfa.accepts(sim.data()) : accepting[s]; }
+
+  typename RL::Subsets nfa;
+  std::array<u8, 256> byteClass;
+  i32 classes;
+  i32 capacity;
+  BitsetTable cache;
+  // Cached transitions, row-major state x class, UNKNOWN until first taken.
+  std::vector<i32> next;
+  std::vector<T> tags;
+  std::vector<u8> accepting;
+  std::vector<u64> startSet;
+  std::vector<u64> sim;
+  std::vector<u64> scratch;
+  i32 start = DEAD;
+  u64 bytes = 0;
+  u64 flushedAt = 0;
+};
+
+// A lexer generated entirely at compile time: every { regex, tag } pair in
+// `rules` is parsed and alternated in order, then dfa(), minimise() and
+// compile() run in a constant expression and the table is copied into fixed
+// size arrays, so the match loop sees the class count as a constant.
+template <typename RL, const auto& rules>
+struct StaticRegexLexer {
+  using state_t = typename RL::state_t;
+
+  static constexpr RL build() {
+    RL regex;
+    for (const auto& [r, t] : rules) regex.alter(RL::parse(r, t));
+    regex.dfa();
+    regex.minimise();
+    return regex;
+  }
+
+  static constexpr std::pair<i32, i32> shape = [] {
+    const auto regex = build();
+    return std::pair<i32, i32>(regex.states.size(), regex.classes);
+  }();
+  static constexpr i32 dead = shape.first;
+  static constexpr i32 classes = shape.second;
+
+  constexpr StaticRegexLexer() {
+    const auto regex = build();
+    std::copy(regex.table.begin(), regex.table.end(), table.begin());
+    std::copy(regex.states.begin(), regex.states.end(), states.begin());
+    std::copy(regex.accepting.begin(), regex.accepting.end(), accepting.begin());
+    std::copy(regex.accel.begin(), regex.accel.end(), accel.begin());
+    byteClass = regex.byteClass;
+    states[dead] = RL::null;
+    start = regex.start;
+  }
+
+  constexpr state_t match(const std::string_view& str) const {
+    return match(str, 0).first;
+  }
+
+  constexpr std::pair<state_t, Location> match(const std::string_view& str, i32 i) const {
+    auto curr = start;
+    if (i >= str.length()) return { RL::null, { i, i } };
+    const i32 n = str.length();
+    auto j = i;
+    for (; j < n; ++j) {
+      const auto next = table[curr * classes + byteClass[static_cast<u8>(str[j])]];
+      if (next == dead) break;
+      if (next == curr && accel[curr].mode) j = accel[curr].scan(str.data(), j + 1, n) - 1;
+      curr = next;
+    }
+    return { states[curr], { i, j } };
+  }
+
+  constexpr std::pair<state_t, i32> munch(const std::string_view& str, i32 i) const {
+    const auto* p = str.data();
+    const i32 n = str.length();
+    i32 reach;
+    return maximalMunch<state_t, RL::null>(i, n, start, dead,
+      [&](i32 s, i32& j) {
+        const auto next = table[s * classes + byteClass[static_cast<u8>(p[j])]];
+        if (next == s && accel[s].mode) j = accel[s].scan(p, j + 1, n) - 1;
+        return next;
+      },
+      [&](i32 s) { return accepting[s]; },
+      [&](i32 s) { return states[s]; }, reach);
+  }
+
+  Tokens<state_t> tokenize(const std::string_view& str, Recovery recovery = Recovery::Stop) const {
+    Tokens<state_t> out;
+    munchUntil<state_t, RL::null>(0, str.length(), out, recovery, [&](i32 i) { return munch(str, i); });
+    return out;
+  }
+
+  std::array<i32, (dead + 1) * classes> table {};
+  std::array<state_t, dead + 1> states {};
+  std::array<u8, dead + 1> accepting {};
+  std::array<Accel, dead + 1> accel {};
+  std::array<u8, 256> byteClass {};
+  i32 start = 0;
+};
+
+// A compiled DFA loaded from a file written by RegexLexer::save. The tables
+// are used in place from a shared read-only mapping where mmap is available,
+// so processes loading the same image share its pages.
+template <typename T, T T_NULL>
+struct RegexImage : RegexView<T, T_NULL> {
+  using H = RegexImageHeader;
+
+  // Returns nothing if the file is missing, truncated, corrupt, written for
+  // another tag type or format version, or built from a different grammar.
+  static std::optional<RegexImage> load(const char* path, u64 fingerprint) {
+    RegexImage image;
+#if __has_include(<sys/mman.h>)
+    const auto fd = ::open(path, O_RDONLY);
+    if (fd < 0) return {};
+    struct stat st;
+    const auto statted = ::fstat(fd, &st) == 0 && st.st_size >= H::BODY;
+    void* p = statted ? ::mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+    ::close(fd);
+    if (p == MAP_FAILED) return {};
+    image.mapping = p;
+    image.size = st.st_size;
+    const auto* data = static_cast<const char*>(p);
+#else
+    auto* f = std::fopen(path, "rb");
+    if (!f) return {};
+    std::fseek(f, 0, SEEK_END);
+    image.size = std::max<long>(std::ftell(f), 0);
+    std::fseek(f, 0, SEEK_SET);
+    image.owned.resize((image.size + 7) / 8);
+    const auto read = std::fread(image.owned.data(), 1, image.size, f);
+    std::fclose(f);
+    if (read != image.size || image.size < H::BODY) return {};
+    const auto* data = reinterpret_cast<const char*>(image.owned.data());
+#endif
+    if (!image.bind(data, fingerprint)) return {};
+    return image;
+  }
+
+  RegexImage(RegexImage&& x) { *this = std::move(x); }
+  RegexImage& operator=(RegexImage&& x) {
+    if (this == &x) return *this;
+    unmap();
+    static_cast<RegexView<T, T_NULL>&>(*this) = x;
+    alphabet = x.alphabet;
+    mapping = std::exchange(x.mapping, nullptr);
+    size = std::exchange(x.size, 0);
+    owned = std::move(x.owned);
+    return *this;
+  }
+  ~RegexImage() { unmap(); }
+
+  std::string_view alphabet;
+
+private:
+  RegexImage() : RegexView<T, T_NULL>() {}
+
+  bool bind(const char* data, u64 fingerprint) {
+    H h;
+    std::memcpy(&h, data, sizeof(h));
+    if (std::memcmp(h.magic, H::MAGIC, sizeof(h.magic)) || h.version != H::VERSION || h.tagSize != sizeof(T)) return false;
+    if (h.fingerprint != fingerprint || h.size != size || h.dead < 0 || h.classes < 1 || h.classes > 256) return false;
+    if (h.start < 0 || h.start >= std::max(h.dead, 1) || h.alphabetSize < 0) return false;
+    const auto fits = [&](u64 at, u64 count, u64 width) {
+      return at % 64 == 0 && at >= H::BODY && at <= size && count * width <= size - at;
+    };
+    const u64 rows = h.dead + 1;
+    if (!fits(h.table, rows * h.classes, sizeof(i32)) || !fits(h.states, h.dead, sizeof(T)) ||
+        !fits(h.accepting, rows, 1) || !fits(h.accel, rows, sizeof(Accel)) || !fits(h.byteClass, 256, 1) ||
+        !fits(h.alphabet, h.alphabetSize, 1)) return false;
+    if (fnv1a({ data + H::BODY, size - H::BODY }) != h.checksum) return false;
+    // The checksum only catches accidents. Matching indexes with these
+    // unchecked, so a well formed file with bad entries is refused too.
+    const auto* table = reinterpret_cast<const i32*>(data + h.table);
+    const auto* byteClass = reinterpret_cast<const u8*>(data + h.byteClass);
+    if (!std::all_of(table, table + rows * h.classes, [&](i32 s) { return s >= 0 && s <= h.dead; })) return false;
+    if (!std::all_of(byteClass, byteClass + 256, [&](u8 c) { return c < h.classes; })) return false;
+
+    this->table = table;
+    this->states = reinterpret_cast<const T*>(data + h.states);
+    this->accepting = reinterpret_cast<const u8*>(data + h.accepting);
+    this->accel = reinterpret_cast<const Accel*>(data + h.accel);
+    this->byteClass = byteClass;
+    this->classes = h.classes;
+    this->dead = h.dead;
+    this->start = h.start;
+    alphabet = { data + h.alphabet, static_cast<size_t>(h.alphabetSize) };
+    return true;
+  }
+
+  void unmap() {
+#if __has_include(<sys/mman.h>)
+    if (mapping) ::munmap(mapping, size);
+#endif
+    mapping = nullptr;
+  }
+
+  void* mapping = nullptr;
+  size_t size = 0;
+  std::vector<u64> owned;
 };
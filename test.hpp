@@ -1,8 +1,11 @@
 #pragma once
 #include <cassert>
+#include <tuple>
 #include "base.hpp"
 
 // BASE_TEST_REGEX
+// BASE_TEST_STATIC_REGEX (needs a raised constexpr limit, see makefile)
+// BASE_TEST_FLY
 
 namespace Base {
 #ifdef BASE_TEST_REGEX
@@ -53,6 +56,16 @@ using RL = RegexLexer<TokenType, TokenType::Null, [](TokenType a, TokenType b){
   }
 }>;
 
+inline constexpr std::pair<std::string_view, TokenType> tokenRules[] = {
+#define _(t, r) { r, TokenType::t },
+TOKEN_TYPE(_)
+#undef _
+};
+
+inline constexpr std::pair<std::string_view, TokenType> smallRules[] = {
+  { "if", TokenType::If }, { "[ \t\n]+", TokenType::Whitespace }, { "==", TokenType::Equal }, { "=", TokenType::Assign },
+};
+
 auto tokenTypeToString(TokenType t) {
   switch (t) {
 #define _(t, r) case TokenType::t: return #t;
@@ -62,27 +75,114 @@ TOKEN_TYPE(_)
 }
 auto regexsize(const RL& regex) {
   auto size = 0;
-  for (const auto& m : regex.transitions) {
-    for (const auto& _ : m) ++size;
-  }
+  for (auto i = 0; i < regex.dead * regex.classes; ++i) size += regex.table[i] != regex.dead;
   return size;
 }
 #endif
 
 void basetest() {
 #ifdef BASE_TEST_REGEX
+  {
+    std::array<std::byte, 1024> buffer;
+    std::pmr::monotonic_buffer_resource arena(buffer.data(), buffer.size());
+    pmr_mvector<i32, 2> xs(&arena);
+    for (i32 k = 0; k < 10; ++k) xs.push_back(k);
+    const auto* block = reinterpret_cast<const std::byte*>(xs.begin());
+    assert(!xs.isInline() && xs.size() == 10 && xs[9] == 9);
+    assert(block >= buffer.data() && block < buffer.data() + buffer.size());
+    const auto ys = std::move(xs);
+    assert(ys.begin() == reinterpret_cast<const i32*>(block) && xs.empty());
+    const mvector<i32, 2> zs = { 1, 2 };
+    assert(zs.isInline() && zs.size() == 2);
+  }
 
   RL regex;
 #define _(t, r) regex.alter(RL::parse(r, TokenType::t));
 TOKEN_TYPE(_);
 #undef _
 
+  const auto nfa = regex;
   regex.dfa();
+  auto parallel = nfa;
+  parallel.dfa(3);
+  assert(parallel.table == regex.table && parallel.states == regex.states && parallel.accept.size() == regex.accept.size());
   
-#define print printf("states: %lu transitions: %u\n", regex.states.size(), regexsize(regex))
+#define print printf("states: %lu classes: %d transitions: %u\n", regex.states.size(), regex.classes, regexsize(regex))
 
   //print;
+  auto naive = regex;
+  naive.minimiseNaive();
   regex.minimise();
+  assert(regex.states.size() == naive.states.size());
+#ifdef REGEX_STATS
+  assert(regex.stats.minimisedStates == regex.states.size() && regex.stats.dfaStates >= regex.stats.minimisedStates);
+  assert(regex.stats.transitions == regexsize(regex) && regex.stats.subsetPeak > 0 && regex.stats.minimiseRounds > 0);
+  regex.matchStats.tokens = 0;
+  assert(regex.tokenize("if x == \"a").size() == 6 && regex.matchStats.tokens == 6 && regex.matchStats.backtrack >= 2);
+#endif
+
+  auto ruled = RL::fromRules(tokenRules);
+  ruled.dfa().minimise();
+  assert(ruled.states.size() == regex.states.size());
+  std::vector<i32> priority(std::size(tokenRules), 1);
+  priority[static_cast<i32>(TokenType::Identifier)] = 0;
+  assert(RL::fromRules(tokenRules, priority).dfa().match("if") == TokenType::Identifier);
+
+  // Ranges are the same as spelling the bytes out; either way a class takes
+  // an edge per run of bytes.
+  auto ranged = RL::parse("[_$a-zA-Z][_$a-zA-Z0-9]*", TokenType::Identifier);
+  auto spelled = RL::parse(tokenRules[static_cast<i32>(TokenType::Identifier)].first, TokenType::Identifier);
+  assert(ranged.transitions.edges.size() == spelled.transitions.edges.size() && ranged.transitions.edges.size() < 16);
+  assert(ranged.dfa().minimise().states.size() == spelled.dfa().minimise().states.size() && ranged.classes == spelled.classes);
+  auto dashes = RL::parse("[-a\\-c-e\\]-]+", TokenType::Minus);
+  dashes.dfa();
+  assert(dashes.match("-a]d") == TokenType::Minus && dashes.match("b") == TokenType::Null);
+  for (const auto bad : { "[z-a]", "[ab", "[a\\]", "ab\\" }) {
+    auto rejected = false;
+    try {
+      RL::parse(bad, TokenType::Minus);
+    }
+    catch (const std::invalid_argument&) {
+      rejected = true;
+    }
+    assert(rejected);
+  }
+  auto notLower = RL::parse("[^a-z\\n]+", TokenType::Plus);
+  notLower.dfa();
+  assert(notLower.match("AZ\t") == TokenType::Plus && notLower.match("Aq", 0).second.end == 1 && notLower.match("\n") == TokenType::Null);
+
+  // The keywords as a side table rather than rules of their own.
+  std::vector<std::pair<std::string_view, TokenType>> unkeyworded, keywords;
+  for (const auto& rule : tokenRules) {
+    (rule.second >= TokenType::Type && rule.second <= TokenType::While ? keywords : unkeyworded).push_back(rule);
+  }
+  auto keyworded = RL::fromRules(unkeyworded);
+  keyworded.withKeywords(keywords, TokenType::Identifier).dfa().minimise();
+  assert(keyworded.states.size() < regex.states.size());
+  assert(keyworded.match("isnot") == TokenType::IsNot && keyworded.match("isnotx") == TokenType::Identifier);
+  assert(keyworded.munch("while(", 0).first == TokenType::While && keyworded.match("i") == TokenType::Identifier);
+  // Keywords past one hash word and past the last length bit.
+  const std::string longWord(70, 'k');
+  const std::pair<std::string_view, TokenType> longWords[] = { { "openmacro", TokenType::OpenMacro }, { longWord, TokenType::Macro } };
+  const KeywordTable<TokenType, TokenType::Null> longTable(longWords, TokenType::Identifier);
+  assert(longTable.find("openmacro") == TokenType::OpenMacro && longTable.find(longWord) == TokenType::Macro);
+  assert(longTable.find("openmacr") == TokenType::Null && longTable.find(longWord + "k") == TokenType::Null && longTable.find("") == TokenType::Null);
+  // `_` is its own rule, so the walk accepts it before the identifier; split
+  // there, the keyword has to be put back together from both chunks.
+  const std::pair<std::string_view, TokenType> underscored[] = { { "_", TokenType::Minus }, { "[_a-z]+", TokenType::Identifier } };
+  const std::pair<std::string_view, TokenType> underscoredWords[] = { { "_ab", TokenType::While } };
+  auto underscore = RL::fromRules(underscored);
+  underscore.withKeywords(underscoredWords, TokenType::Identifier).dfa();
+  StreamLexer<TokenType, TokenType::Null> split(underscore.view(), Recovery::Skip);
+  std::vector<TokenType> splitTags;
+  const auto splitEmit = [&](TokenType tag, u64, u64) { splitTags.push_back(tag); };
+  split.push("_", splitEmit);
+  split.push("ab _", splitEmit);
+  split.finish(splitEmit);
+  assert(splitTags == std::vector<TokenType>({ TokenType::While, TokenType::Null, TokenType::Minus }));
+  auto copied = keyworded;
+  const auto moved = std::move(copied);
+  assert(keyworded.match("while") == TokenType::While && moved.match("while") == TokenType::While);
   //print;
 
   /*
@@ -106,6 +206,208 @@ TOKEN_TYPE(_);
   assert(regex.match("\t\n ") == TokenType::Whitespace);
   assert(regex.match("\"Hello World\\n\"") == TokenType::String);
 
+  const auto tokens = regex.tokenize("if x == \"a b\"");
+  const TokenType expected[] = { TokenType::If, TokenType::Whitespace, TokenType::Identifier, TokenType::Whitespace,
+                                 TokenType::Equal, TokenType::Whitespace, TokenType::String };
+  assert(tokens.size() == std::size(expected));
+  assert(std::equal(tokens.tags.begin(), tokens.tags.end(), std::begin(expected)));
+  assert(tokens.starts[4] == 5 && tokens.ends[4] == 7);
+  assert(regex.tokenize("ab \"cd").size() == 2);
+  const auto skipped = regex.tokenize("ab \"cd", Recovery::Skip);
+  assert(skipped.size() == 4 && skipped.tags[2] == TokenType::Null && skipped.ends[2] == 4);
+  assert(skipped.tags[3] == TokenType::Identifier && skipped.ends[3] == 6);
+
+  const auto longRuns = std::string(1000, ' ') + "\"" + std::string(5000, 'x') + "\" a";
+  const auto runs = regex.tokenize(longRuns);
+  assert(runs.size() == 4 && runs.ends[0] == 1000 && runs.tags[1] == TokenType::String && runs.ends[1] == 6002);
+  assert(regex.match(longRuns, 1000).second.end == 6002);
+
+  // More strings than lanes, so lanes are refilled, with empty ones mixed in.
+  std::vector<std::string_view> words;
+  for (auto i = 0; i < 40; ++i) words.insert(words.end(), { "", "!=", "ife", "isnot", "\t\n ", "\"a b\"", "x\"", longRuns });
+  std::vector<TokenType> classified(words.size());
+  regex.matchMany(words, classified);
+  for (auto i = 0; i < words.size(); ++i) assert(classified[i] == regex.match(words[i]));
+  keyworded.matchMany(words, classified);
+  for (auto i = 0; i < words.size(); ++i) assert(classified[i] == regex.match(words[i]));
+
+  static constexpr StaticRegexLexer<RL, smallRules> smallRegex;
+  static_assert(smallRegex.match("if") == TokenType::If && smallRegex.match("==") == TokenType::Equal);
+  static_assert(smallRegex.munch("  \t=", 0).second == 3);
+  assert(smallRegex.tokenize("if == =").size() == 5);
+#ifdef BASE_TEST_STATIC_REGEX
+  static constexpr StaticRegexLexer<RL, tokenRules> staticRegex;
+  static_assert(staticRegex.match("isnot") == TokenType::IsNot);
+  static_assert(staticRegex.match("\"a\"", 0).second.end == 3);
+  assert(staticRegex.dead == regex.states.size());
+  assert(staticRegex.tokenize(longRuns).tags == runs.tags && staticRegex.tokenize(longRuns).ends == runs.ends);
+#endif
+
+  const auto fingerprint = RL::fingerprint(tokenRules);
+  assert(regex.save("basetest.rgx", fingerprint));
+  assert(!keyworded.save("basetest.rgx", fingerprint));
+  assert(!(RegexImage<TokenType, TokenType::Null>::load("basetest.rgx", fingerprint + 1)));
+  {
+    const auto image = RegexImage<TokenType, TokenType::Null>::load("basetest.rgx", fingerprint);
+    assert(image && image->alphabet.size() == regex.alphabet.size());
+    assert(image->match("isnot") == TokenType::IsNot);
+    assert(image->tokenize(longRuns).ends == runs.ends);
+  }
+  {
+    // Out of range entries are refused even under a matching checksum.
+    std::string file;
+    auto* f = std::fopen("basetest.rgx", "rb");
+    for (int c; (c = std::fgetc(f)) != EOF;) file += static_cast<char>(c);
+    std::fclose(f);
+    const auto rewrite = [&](std::string bytes) {
+      RegexImageHeader h;
+      std::memcpy(&h, bytes.data(), sizeof(h));
+      h.checksum = fnv1a(std::string_view(bytes).substr(RegexImageHeader::BODY));
+      std::memcpy(bytes.data(), &h, sizeof(h));
+      f = std::fopen("basetest.rgx", "wb");
+      std::fwrite(bytes.data(), 1, bytes.size(), f);
+      std::fclose(f);
+      return RegexImage<TokenType, TokenType::Null>::load("basetest.rgx", fingerprint).has_value();
+    };
+    RegexImageHeader h;
+    std::memcpy(&h, file.data(), sizeof(h));
+    assert(rewrite(file));
+    auto badState = file;
+    const i32 past = h.dead + 1;
+    std::memcpy(&badState[h.table], &past, sizeof(past));
+    assert(!rewrite(badState));
+    auto badClass = file;
+    badClass[h.byteClass + 'a'] = static_cast<char>(h.classes);
+    assert(!rewrite(badClass));
+  }
+  std::remove("basetest.rgx");
+
+  // tokenizeParallel only splits input into chunks of 64 KB or more, too
+  // much to lex again on every one of main's repeats, so it is checked once.
+  static auto parallelChecked = false;
+  if (!std::exchange(parallelChecked, true)) {
+    std::string big;
+    while (big.size() < 100000) big += "while x isnot \"str ing\" { y = x; }\n";
+    big += "\"" + big + "\"";
+    while (big.size() < 300000) big += "fn f(a, b) :: c # d\t";
+    for (const auto recovery : { Recovery::Stop, Recovery::Skip }) {
+      const auto seq = regex.tokenize(big + "`" + big, recovery);
+      const auto par = regex.tokenizeParallel(big + "`" + big, recovery, 4);
+      assert(seq.tags == par.tags && seq.starts == par.starts && seq.ends == par.ends);
+    }
+  }
+
+  // The same shape at a tenth of the size: statements, then the tail of a
+  // long string whose closing quote opens one that never closes.
+  std::string sample;
+  while (sample.size() < 10000) sample += "while x isnot \"str ing\" { y = x; }\n";
+  sample += "\"" + sample + "\"";
+  while (sample.size() < 30000) sample += "fn f(a, b) :: c # d\t";
+
+  LazyRegexLexer<RL> lazy(nfa), tiny(nfa, 8);
+  assert(lazy.match("isnot") == TokenType::IsNot && lazy.munch("  \t=", 0).second == 3);
+  const auto some = sample.substr(0, 2000) + "`" + sample.substr(20000, 2000);
+  for (auto* l : { &lazy, &tiny }) {
+    const auto seq = regex.tokenize(some, Recovery::Skip);
+    const auto lz = l->tokenize(some, Recovery::Skip);
+    assert(seq.tags == lz.tags && seq.starts == lz.starts && seq.ends == lz.ends);
+  }
+  assert(ruled.tokenize(some).tags == regex.tokenize(some).tags);
+  assert(keyworded.tokenize(some).tags == regex.tokenize(some).tags);
+  // Renumbering only moves rows and columns around.
+  auto bfs = regex, profiled = regex;
+  bfs.renumber();
+  profiled.renumber(some);
+  assert(bfs.start == 0 && profiled.states.size() == regex.states.size() && profiled.classes == regex.classes);
+  for (const auto* r : { &bfs, &profiled }) {
+    const auto seq = regex.tokenize(some, Recovery::Skip);
+    const auto moved = r->tokenize(some, Recovery::Skip);
+    assert(seq.tags == moved.tags && seq.starts == moved.starts && seq.ends == moved.ends);
+  }
+  assert(lazy.stats.hits > lazy.stats.misses && !lazy.stats.flushes);
+  assert(tiny.stats.flushes && tiny.size() <= 8);
+  // Small enough to thrash as a walk starts, so it begins simulating.
+  LazyRegexLexer<RL> thrashing(nfa, 3);
+  std::string repeated;
+  for (auto i = 0; i < 64; ++i) repeated += "while x isnot y == z ";
+  const auto thrashed = thrashing.tokenize(repeated, Recovery::Skip), unthrashed = regex.tokenize(repeated, Recovery::Skip);
+  assert(thrashed.tags == unthrashed.tags && thrashed.ends == unthrashed.ends && thrashing.stats.hits);
+
+  IncrementalLexer<TokenType, TokenType::Null> inc(regex.view());
+  std::string text = "x = \"ab\" isnot y`";
+  inc.lex(text);
+  // Opening a quote swallows the rest, closing it gives the tokens back.
+  for (const auto& [at, removed, ins] : std::vector<std::tuple<i32, i32, std::string>> {
+    { 0, 0, "fn " }, { 7, 0, "\"" }, { 7, 1, "" }, { 4, 3, "==" }, { 18, 1, " ok" }, { 0, 21, "" } }) {
+    text.replace(at, removed, ins);
+    inc.edit(text, at, removed, ins.size());
+    const auto full = regex.tokenize(text, Recovery::Skip);
+    const auto kept = inc.tokens();
+    assert(kept.tags == full.tags && kept.starts == full.starts && kept.ends == full.ends);
+  }
+  // An edit that doesn't account for the new length is refused.
+  auto mismatched = false;
+  try {
+    inc.edit("abc", 0, 0, 2);
+  }
+  catch (const std::invalid_argument&) {
+    mismatched = true;
+  }
+  assert(mismatched && inc.size() == 0);
+
+  // Pushed a few bytes at a time, so tokens and backtracks cross chunks.
+  for (const auto recovery : { Recovery::Stop, Recovery::Skip }) {
+    StreamLexer<TokenType, TokenType::Null> stream(keyworded.view(), recovery);
+    Tokens<TokenType> streamed;
+    const auto emit = [&](TokenType tag, u64 start, u64 end) { streamed.push_back(tag, start, end); };
+    for (auto i = 0; i < some.size(); i += 7) stream.push(std::string_view(some).substr(i, 7), emit);
+    stream.finish(emit);
+    const auto seq = regex.tokenize(some, recovery);
+    assert(seq.tags == streamed.tags && seq.starts == streamed.starts && seq.ends == streamed.ends);
+    assert(stream.offset() == some.size());
+  }
+
+#endif
+#ifdef BASE_TEST_FLY
+
+  const FlyString fly("fly");
+  assert(fly == FlyString("fly") && fly == std::string("fly") && !(fly == FlyString("flies")));
+  const auto interned = StringPool::global().size();
+  assert(FlyString::find("fly") == fly && !FlyString::find("never interned") && StringPool::global().size() == interned);
+  assert(sizeof(FlyString) == 4 && *fly == "fly");
+  {
+    // An empty first string, and one too long for a chunk between two that fit.
+    StringPool pool;
+    const auto empty = pool.intern(""), small = pool.intern("abc");
+    const std::string big(StringPool::CHUNK * 2, 'x');
+    const auto huge = pool.intern(big), after = pool.intern("def");
+    assert(pool[empty] == "" && pool[small] == "abc" && pool[huge] == big && pool[after] == "def");
+    assert(pool.intern("") == empty && pool.intern(big) == huge && pool.intern("abc") == small);
+    const FlyString longFly(std::string(100000, 'x')), shortFly("abc");
+    assert(*shortFly == "abc" && (*longFly).size() == 100000);
+  }
+
+  std::vector<SharedFlyString> shared(8);
+  std::vector<std::thread> workers;
+  for (auto t = 0; t < shared.size(); ++t) {
+    workers.emplace_back([&, t] {
+      for (auto i = 0; i < 1000; ++i) SharedFlyString(std::to_string((i * 7 + t) % 300));
+      shared[t] = SharedFlyString("shared");
+    });
+  }
+  for (auto& w : workers) w.join();
+  assert(std::count(shared.begin(), shared.end(), shared[0]) == shared.size() && *shared[0] == "shared");
+
+  using Counted = FlyResource<std::string, FlyCountedPool<std::string>>;
+  FlyCountedPool<std::string> counted;
+  for (auto i = 0; i < 1000; ++i) {
+    const Counted a(std::to_string(i), counted), b(std::to_string(i), counted);
+    auto c = a;
+    c = Counted("other", counted);
+    assert(a == b && counted.size() == 2);
+  }
+  assert(counted.size() == 0);
+
 #endif
 }
 }